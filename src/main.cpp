@@ -1,53 +1,548 @@
 #include <Arduino.h>
 #include <LiquidCrystal_I2C.h>
 #include <Ethernet.h>
+#include <Dhcp.h>
 #include <SD.h>
 #include <ArduinoJson.h>
 #include <SPI.h>
 #include <ArduinoMDNS.h>
 #include <EthernetUdp.h>
-#include <NTPClient.h>
+#include <Dns.h>
 #include <TimeLib.h>
+#include <EEPROM.h>
+#include <avr/wdt.h>
 
 // Configuration
-const int NUM_BATTERIES = 10;
-const int ANALOG_PINS[16] = {A0, A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11, A12, A13, A14, A15};
+const int MAX_BATTERIES = 16;
+const int ANALOG_PINS[MAX_BATTERIES] = {A0, A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11, A12, A13, A14, A15};
 const float BATTERY_VOLTAGE_MAX = 12.0; // Maximum battery voltage being monitored
 const float ARDUINO_REF_VOLTAGE = 5.0;  // Arduino analog reference voltage
-const unsigned long LOG_INTERVAL = 60000; // Log every minute
-const unsigned long DISPLAY_UPDATE = 2000; // Update display every 2 seconds
 const int SD_CS_PIN = 4; // SD card CS pin (default for Ethernet Shield)
 
-// Time configuration
-const long TIMEZONE_OFFSET = -4 * 3600; // UTC offset in seconds (EST = -5 hours)
-const char* NTP_SERVER = "pool.ntp.org";
+// The log is split into numbered segments (LOG00001.CSV, LOG00002.CSV, ...)
+// and the highest one is written to. A battery.csv left by older firmware is
+// kept as segment 0, the oldest.
+const char* LEGACY_LOG_FILE = "battery.csv";
+const uint32_t LOG_SEGMENT_MAX_BYTES = 1048576; // Start a new segment past this size
+const uint16_t LOG_SEGMENT_LIMIT = 65535;
+
+// SD free space: the FAT is counted after boot, FREE_SCAN_BLOCKS_PER_PASS
+// blocks per loop pass, then kept current from every file the firmware writes
+// and from pruned segments, so checks never touch the FAT. It is recounted
+// every SD_FREE_RESCAN_INTERVAL to pick up what that misses (directory
+// clusters, files changed by hand). The oldest segments are deleted when free
+// space drops below SD_PRUNE_BELOW_PERCENT of the card.
+const uint8_t FREE_SCAN_BLOCKS_PER_PASS = 4;
+const unsigned long SD_FREE_RESCAN_INTERVAL = 86400000UL; // 24 h
+const uint8_t SD_PRUNE_BELOW_PERCENT = 5;
+const uint8_t SD_PRUNE_TARGET_PERCENT = 10;
+
+// Run-length encoding: a sample whose data columns (everything after the
+// tick) match the last record's, from the same boot and about one log
+// interval after the sample before it, is not written. The run is written as
+// "R,<count>,<interval_ms>" when the data changes, the segment ends, or
+// LOG_RUN_MAX samples have built up: the previous record repeated count
+// times, interval_ms apart. Repeats not yet written survive a warm reset
+// but are lost on power loss.
+const uint16_t LOG_RUN_MAX = 60;
+
+// Boot-time log recovery: the tail is scanned backwards for the last complete
+// record in LOG_RECOVERY_WINDOW-byte steps, giving up after
+// LOG_RECOVERY_MAX_SCAN bytes (far longer than any record).
+const uint16_t LOG_RECOVERY_WINDOW = 64;
+const uint16_t LOG_RECOVERY_MAX_SCAN = 1024;
+
+// Log integrity: each flush of samples forms a block closed by a
+// "#<seq>,<crc32>" trailer line, the CRC covering the block's record bytes.
+// Readers verify a block before using it, LOG_SCAN_CHUNK bytes per step.
+const uint16_t LOG_SCAN_BUFFER = 64;
+const uint16_t LOG_SCAN_CHUNK = 1024;
+
+// Defaults for the runtime configuration (overridden by config.json / EEPROM)
+const uint8_t DEFAULT_NUM_BATTERIES = 10;
+const unsigned long DEFAULT_LOG_INTERVAL = 60000; // Log every minute
+const unsigned long DEFAULT_DISPLAY_UPDATE = 2000; // Update display every 2 seconds
+const long DEFAULT_TIMEZONE_OFFSET = -4 * 3600; // UTC offset in seconds (EST = -5 hours)
+const char DEFAULT_NTP_SERVER[] PROGMEM = "pool.ntp.org";
+const char DEFAULT_DEVICE_ID[] PROGMEM = "3572";  // Set your custom device identifier here
+const byte DEFAULT_MAC[6] = {0xA8, 0x61, 0x0A, 0xAE, 0x34, 0xF2};
+
+// Series strings ("banks"). Each battery may be assigned to one bank; the
+// bank total, spread (highest minus lowest cell) and weakest cell are built
+// up cell by cell as each scan is converted. A bank alarms when its spread
+// exceeds the configured limit and clears BANK_ALARM_HYSTERESIS_MV below it.
+const uint8_t MAX_BANKS = 4;
+const uint16_t DEFAULT_BANK_SPREAD_ALARM_MV = 300;
+const uint16_t BANK_ALARM_HYSTERESIS_MV = 20;
+
+// Early warning of sudden drops. Each channel runs a one-sided CUSUM of its
+// shortfall below a slow baseline: every scan adds (baseline - reading -
+// drift) and the sum is floored at zero, so slow discharge (less than the
+// drift per scan) never accumulates while a step of D millivolts trips the
+// threshold after about threshold / (D - drift) scans. A detection is an
+// event: the detector re-arms at the new level and the warning is shown for
+// DROP_WARNING_HOLD_MS.
+const uint16_t DEFAULT_CUSUM_DRIFT_MV = 50;
+const uint16_t DEFAULT_CUSUM_THRESHOLD_MV = 400;
+const uint8_t DROP_BASELINE_SHIFT = 6;             // Baseline follows 1/64 of each reading
+const uint8_t DROP_WARMUP_SCANS = 64;              // Scans before a detector arms
+const unsigned long DROP_WARNING_HOLD_MS = 300000;
+
+// Channel faults. A divider that has come off leaves its pin floating, and a
+// shorted one holds it at 0; both still convert to plausible voltages.
+// Each scan looks for three signs:
+//  - rail low: a code within FAULT_RAIL_MARGIN of 0;
+//  - noise: the smoothed change between scans above FAULT_NOISE_LIMIT codes
+//    (a floating input wanders with hum and with the channel before it);
+//  - pull test: one channel per scan, after the capture, is converted again
+//    with its internal pull-up (20-50 kOhm) on. A divider barely moves; a
+//    floating pin is pulled to the rail.
+// A sign must persist for FAULT_CONFIRM_SCANS scans to raise a fault and be
+// gone for FAULT_CLEAR_SCANS to clear it. Faulted channels are still reported
+// but take no part in the health, bank, drop and daily statistics logic.
+// A code near 1023 is not a fault: the nominal divider reaches full scale
+// at 12.0 V, below a charged battery, so it is only flagged as over range
+// and the channel stays in every check. Only a pull test that sees the pin
+// rise counts a channel as an open wire.
+enum ChannelFaultType { FAULT_NONE, FAULT_OPEN_WIRE, FAULT_RAIL_LOW, FAULT_NOISY, FAULT_TYPE_COUNT };
+const char FAULT_NAMES[FAULT_TYPE_COUNT][10] PROGMEM = {"none", "open_wire", "rail_low", "noisy"};
+const char FAULT_LABELS[FAULT_TYPE_COUNT][10] PROGMEM = {"", "OPEN WIRE", "RAIL LOW", "NOISY"};
+const int FAULT_RAIL_MARGIN = 4;                   // ADC codes from either end
+const int FAULT_PULL_RISE = 64;                    // Minimum rise under the pull-up for an open wire
+const uint16_t FAULT_NOISE_LIMIT = 24;             // Mean change between scans, ADC codes
+const uint8_t FAULT_NOISE_SHIFT = 3;               // Noise average follows 1/8 of each change
+const uint8_t FAULT_CONFIRM_SCANS = 16;
+const uint8_t FAULT_CLEAR_SCANS = 64;
+
+// Daily percentiles. Each battery feeds an extended P² estimator (Jain &
+// Chlamtac, in Raatikainen's multi-quantile form) for P5, P50 and P95 every
+// STATS_SAMPLE_INTERVAL, so a day holds at most 43200 observations and marker
+// positions fit in 16 bits. The estimators restart at local midnight; the
+// finished day is appended to DAILY_SUMMARY_FILE, where /api/stats reads it.
+const unsigned long STATS_SAMPLE_INTERVAL = 2000;
+const uint8_t QUANTILE_COUNT = 3;
+const uint8_t QUANTILE_MARKERS = 2 * QUANTILE_COUNT + 1; // Interior markers; odd ones are the estimates
+const float QUANTILE_TARGETS[QUANTILE_MARKERS] PROGMEM = {0.025, 0.05, 0.275, 0.50, 0.725, 0.95, 0.975};
+const char* DAILY_SUMMARY_FILE = "DAILY.CSV";
+const uint8_t DAILY_LINE_MAX = 64;                   // Longest DAILY_SUMMARY_FILE line, with terminator
+const uint8_t DAILY_STAT_COUNT = QUANTILE_COUNT + 2; // The quantiles, then min and max
+const char DAILY_STAT_NAMES[DAILY_STAT_COUNT][4] PROGMEM = {"p5", "p50", "p95", "min", "max"};
+
+// State of charge endpoints for a 12V battery (10V=0%, 12.6V=100%)
+const int32_t SOC_EMPTY_MV = BATTERY_VOLTAGE_MAX * 830;  // 10V for 12V battery
+const int32_t SOC_FULL_MV = BATTERY_VOLTAGE_MAX * 1050;  // 12.6V for 12V battery
+
+// Calibration: millivolts = (raw * gain + offset) >> 16, with gain and offset
+// in Q16. The nominal gain assumes a perfect divider scaling
+// BATTERY_VOLTAGE_MAX to the full ADC range.
+const int32_t NOMINAL_GAIN_Q16 = (int32_t)(BATTERY_VOLTAGE_MAX * 1000.0 * 65536.0 / 1023.0 + 0.5);
+const int EEPROM_CALIBRATION_ADDR = 128;
+const uint16_t CALIBRATION_MAGIC = 0xCA1B;
+const uint8_t CALIBRATION_VERSION = 2;
+const uint8_t CALIBRATION_SAMPLES = 16; // ADC reads averaged per capture
+
+// Supply (AVCC) drift compensation. The ADC reference is AVCC, so every
+// reading scales with the supply rail. Measuring the internal 1.1V bandgap
+// against AVCC gives the actual rail voltage, and the gains of channels
+// calibrated with compensation active are rescaled by actual/nominal. The
+// bandgap's own error (up to +-10%) cancels only for those channels, so
+// uncalibrated ones keep the nominal divider. Only done every
+// AVCC_MEASURE_SCANS scans.
+const int32_t NOMINAL_AVCC_MV = ARDUINO_REF_VOLTAGE * 1000;
+const int32_t BANDGAP_MV = 1100;               // Typical; calibration absorbs the per-chip error
+const uint16_t AVCC_MEASURE_SCANS = 600;       // About once a minute at the loop rate
+const uint16_t BANDGAP_SETTLE_US = 1000;       // Reference settling after switching the mux
+const uint8_t BANDGAP_SAMPLES = 4;
+const int32_t AVCC_MIN_MV = 4000;              // Readings outside this range are ignored
+const int32_t AVCC_MAX_MV = 5600;
+
+// Time configuration. Time is kept as 64-bit UTC milliseconds: an SNTP
+// reply fixes the time of one millis() reading, and millis() covers the rest.
+// Requests are sent from the loop and replies picked up on later passes.
 const unsigned long NTP_UPDATE_INTERVAL = 3600000; // Update every hour
+const unsigned long NTP_RETRY_INTERVAL = 30000;    // Until the first sync succeeds
+const unsigned long NTP_REPLY_TIMEOUT = 2000;
+const uint16_t NTP_DNS_TIMEOUT = 400;              // Per DNS attempt; a lookup makes up to 3
+const uint8_t NTP_BOOT_ATTEMPTS = 5;
+const uint16_t NTP_PORT = 123;
+const uint16_t NTP_LOCAL_PORT = 2390;
+const uint8_t NTP_PACKET_SIZE = 48;
+const uint32_t NTP_UNIX_OFFSET = 2208988800UL;     // Seconds from 1900 to 1970
+
+// Boot id and clock mapping. Every record carries the boot it was taken in
+// and its millis() tick, which never steps. CLOCK.CSV maps ticks to UTC: a
+// line is added at each boot's first NTP sync and whenever a later sync
+// moves the clock by CLOCK_STEP_THRESHOLD_MS or more. Records taken before
+// the first sync are back-dated from it.
+const int EEPROM_BOOT_ID_ADDR = 512;
+const char* CLOCK_LOG_FILE = "CLOCK.CSV";
+const int32_t CLOCK_STEP_THRESHOLD_MS = 500;
+
+// Optional log columns, detected from each segment's header
+const uint8_t LOG_FORMAT_BOOT_TICK = 0x01; // Boot,Tick_ms after the timestamp
+const uint8_t LOG_FORMAT_RAW_ONLY = 0x02;  // Cal,AVCC_mV then one raw code per battery
+const uint8_t LOG_FORMAT_EPOCH = 0x04;     // Epoch_ms in place of DateTime_UTC
+const uint8_t LOG_FORMAT_BANKS = 0x08;     // BankN_V,BankN_Spread_mV,BankN_Worst after the batteries
+
+// What the log stores (flags). Raw-only records keep the ADC code with the
+// calibration generation and AVCC it was taken under; voltage and SoC are
+// derived when the log is read, using the calibration in force at that time.
+// Epoch records start with integer UTC milliseconds, which sort and compare
+// as they are; ISO-8601 text is only produced for clients that ask for it.
+const uint8_t LOG_MODE_FULL = 0x00;        // ISO time; raw, voltage and percentage
+const uint8_t LOG_MODE_RAW = 0x01;
+const uint8_t LOG_MODE_EPOCH = 0x02;
+
+// Network supervision. Ethernet.maintain() blocks while it talks to the DHCP
+// server, so the DHCP timeouts are kept short enough that a renewal plus a
+// rebind in the same call (about 6 s) still fits in the 8 s watchdog period.
+const unsigned long NETWORK_CHECK_INTERVAL = 1000;   // Link and lease poll period
+const unsigned long DHCP_TIMEOUT = 2000;
+const unsigned long DHCP_RESPONSE_TIMEOUT = 1000;
+const uint8_t DHCP_BOOT_ATTEMPTS = 5;
+const uint8_t DHCP_FAILURES_BEFORE_FALLBACK = 3;     // Failed rebinds before using the fallback address
+const unsigned long DHCP_RETRY_INTERVAL = 60000;     // DHCP retry period on the fallback address
+const byte FALLBACK_IP[4] = {192, 168, 1, 177};
+
+// mDNS responder task. Each loop pass gives the responder up to
+// MDNS_MAX_RUNS_PER_TICK calls (one packet each) within MDNS_TICK_BUDGET_US.
+// Packets still queued when the budget runs out are dropped: by the next
+// pass their answers would be stale, and a backlog only grows on a busy LAN.
+const unsigned long MDNS_TICK_BUDGET_US = 5000;
+const uint8_t MDNS_MAX_RUNS_PER_TICK = 4;
+const uint8_t MDNS_MAX_DROPS_PER_TICK = 16;
+
+// Persistent configuration storage
+const char* CONFIG_FILE = "config.json";
+const int EEPROM_CONFIG_ADDR = 0;
+const uint16_t CONFIG_MAGIC = 0xB47C;
+const uint8_t CONFIG_VERSION = 4;
+
+// SNMP agent configuration
+const uint16_t SNMP_PORT = 161;
+const char SNMP_COMMUNITY[] PROGMEM = "public"; // Read-only community string
+const uint32_t SNMP_ENTERPRISE = 99999;    // Private Enterprise Number for the battery MIB
+const size_t SNMP_MAX_PACKET = 192;        // Largest request/response handled (bytes)
+const uint8_t SNMP_MAX_OID_LEN = 16;       // Longest OID accepted in a request
+
+// Runtime configuration. Parsed once at boot from config.json on the SD
+// card, falling back to the EEPROM image and then to the defaults above.
+// The CRC covers every byte before it.
+struct __attribute__((packed)) DeviceConfig {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t numBatteries;
+  uint32_t logInterval;     // ms
+  uint16_t displayUpdate;   // ms
+  int32_t timezoneOffset;   // seconds east of UTC
+  char ntpServer[32];
+  char deviceId[12];
+  byte mac[6];
+  uint8_t logMode;          // LOG_MODE_* flags, added in version 2
+  uint8_t cellBank[MAX_BATTERIES];  // Bank of each battery, 1-MAX_BANKS or 0 for none (version 3)
+  uint16_t bankSpreadAlarmMv;       // 0 disables the imbalance alarm (version 3)
+  uint16_t cusumDriftMv;            // Drop detector drift allowance per scan (version 4)
+  uint16_t cusumThresholdMv;        // Drop detector threshold, 0 disables it (version 4)
+  uint32_t crc;
+};
+
+// Where the CRC sat in each older layout; later fields take their defaults
+const uint8_t CONFIG_LAYOUT_END[CONFIG_VERSION] = {
+  0,
+  offsetof(DeviceConfig, logMode),
+  offsetof(DeviceConfig, cellBank),
+  offsetof(DeviceConfig, cusumDriftMv),
+};
+
+struct __attribute__((packed)) ChannelCalibration {
+  int32_t gainQ16;     // Q16 millivolts per ADC code
+  int32_t offsetQ16;   // Q16 millivolts
+};
+
+struct __attribute__((packed)) CalibrationTable {
+  uint16_t magic;
+  uint8_t version;
+  uint16_t generation;  // Bumped on every change
+  ChannelCalibration channels[MAX_BATTERIES];
+  uint16_t compensated; // Bit per channel: solved from AVCC-compensated captures (version 2)
+  uint32_t crc;
+};
+
+// The calibration point captured but not yet paired with its partner.
+// Channels are calibrated one at a time, so only one point is ever pending;
+// a capture on another channel replaces it.
+struct CalibrationCapture {
+  uint8_t channel;      // CALIBRATION_NONE when nothing is pending
+  uint8_t point;        // 0 low, 1 high
+  uint16_t rawQ4;       // Average of CALIBRATION_SAMPLES reads in 1/16 codes, AVCC-compensated
+  uint16_t millivolts;  // Reference voltage applied
+};
+
+const uint8_t CALIBRATION_NONE = 0xFF;
+
+DeviceConfig config;
+const __FlashStringHelper* configSource = NULL; // Set by loadConfig()
+bool configRestartRequired = false;
+
+CalibrationTable calibration;
+CalibrationCapture pendingCapture = {CALIBRATION_NONE, 0, 0, 0};
+
+// Calibration gain x AVCC scale, recomputed whenever either changes so the
+// sampling path stays a single multiply-add per channel
+int32_t effectiveGainQ16[MAX_BATTERIES];
+int32_t avccMillivolts = NOMINAL_AVCC_MV;
+int32_t avccScaleQ16 = 65536;
+uint16_t scansSinceAvccMeasure = AVCC_MEASURE_SCANS; // Measure on the first scan
+
+// Watchdog and task liveness. Each loop task brackets its work with
+// beginTask()/endTask(); the watchdog is only fed while every task has
+// completed a pass within TASK_LIVENESS_TIMEOUT.
+enum Task { TASK_SAMPLING, TASK_LOGGING, TASK_NETWORK, TASK_COUNT, TASK_NONE = 0xFF };
+const char TASK_NAMES[TASK_COUNT][9] PROGMEM = {"sampling", "logging", "network"};
+const unsigned long TASK_LIVENESS_TIMEOUT = 5000;
+const uint16_t WATCHDOG_STATE_MAGIC = 0x5744;
+
+// Survives resets (but not power cycles) so the cause of a watchdog reset
+// can be reported on the next boot
+struct WatchdogState {
+  uint16_t magic;
+  uint8_t currentTask;    // Task running when the reset hit, or TASK_NONE
+  uint8_t stalledTask;    // Task that missed its liveness deadline, or TASK_NONE
+  uint16_t watchdogResets;
+};
+
+WatchdogState watchdogState __attribute__((section(".noinit")));
+uint8_t resetFlags __attribute__((section(".noinit")));
+unsigned long taskLastCheckIn[TASK_COUNT];
+const __FlashStringHelper* lastResetCause = NULL; // Set by initWatchdog()
+uint8_t lastStalledTask = TASK_NONE;
+
+// Event tracing. Built with -DTRACE_ENABLED=1, the hot paths record begin/end
+// events (micros(), event id, one argument) into a RAM ring that the "trace"
+// serial command and GET /api/trace dump as Chrome trace JSON, for
+// chrome://tracing or Perfetto. Otherwise the TRACE_* macros expand to
+// nothing and the ring is not compiled in.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+enum TraceEventId {
+  TRACE_READ_BATTERIES,   // arg: channels scanned
+  TRACE_LOG_DATA,         // arg: samples queued
+  TRACE_FLUSH_SAMPLES,    // arg: samples in the ring
+  TRACE_WEB_REQUESTS,
+  TRACE_BULK_CHUNK,       // arg: route
+  TRACE_MDNS_RUN,         // arg: run within the tick
+  TRACE_NTP_UPDATE,       // arg: 1 while a request is pending
+  TRACE_EVENT_COUNT
+};
+
+#if TRACE_ENABLED
+const uint8_t TRACE_RING_SIZE = 64;    // 8 bytes each
+const char TRACE_EVENT_NAMES[TRACE_EVENT_COUNT][18] PROGMEM = {
+  "readBatteries", "logBatteryData", "flushSamples", "handleWebRequests", "bulkChunk", "mdns.run", "updateClock"
+};
+// Loop task each event runs under, shown as its own row (tid) in the viewer
+const uint8_t TRACE_EVENT_TASK[TRACE_EVENT_COUNT] = {
+  TASK_SAMPLING, TASK_LOGGING, TASK_LOGGING, TASK_NETWORK, TASK_NETWORK, TASK_NETWORK, TASK_NETWORK
+};
+
+struct TraceEvent {
+  uint32_t us;
+  uint8_t id;
+  char phase;      // 'B'egin, 'E'nd or 'i'nstant
+  uint16_t arg;
+};
+
+TraceEvent traceRing[TRACE_RING_SIZE];
+uint8_t traceHead = 0;     // Next slot to write
+uint8_t traceCount = 0;
+
+void traceRecord(uint8_t id, char phase, uint16_t arg);
+#define TRACE_BEGIN(id, arg) traceRecord((id), 'B', (arg))
+#define TRACE_END(id, arg) traceRecord((id), 'E', (arg))
+#define TRACE_INSTANT(id, arg) traceRecord((id), 'i', (arg))
+#else
+#define TRACE_BEGIN(id, arg) do {} while (0)
+#define TRACE_END(id, arg) do {} while (0)
+#define TRACE_INSTANT(id, arg) do {} while (0)
+#endif
 
 // Hardware setup
 LiquidCrystal_I2C lcd(0x27, 16, 2);
-byte mac[] = {0xA8, 0x61, 0x0A, 0xAE, 0x34, 0xF2};
 EthernetServer server(80);
+
+// Low-level access to the card alongside the SD library, for operations it
+// does not expose (truncation)
+Sd2Card sdCard;
+SdVolume sdVolume;
+bool sdRawReady = false;
+uint32_t logRepairedBytes = 0;
+char logFileName[13];              // Active log segment
+uint16_t oldestLogSegment = 0;
+uint16_t activeLogSegment = 1;
+uint32_t activeLogSize = 0;
+bool logWriteFailed = false;       // Last flush stopped part way; its fragment is voided next time
+uint32_t sdFreeClusters = 0;
+uint32_t sdFreeScanCount = 0;      // Free clusters counted so far by the running scan
+uint32_t sdFreeScanBlock = 0;      // Next FAT block to count
+unsigned long sdFreeScanTime = 0;  // millis() when the last scan started
+bool sdFreeScanning = false;
+bool sdFreeKnown = false;
+uint32_t logSegmentsPruned = 0;
+uint32_t activeHeaderCrc = 0;      // CRC of the active segment's header line
+uint32_t logBlockSeq = 0;          // Sequence number of the next log block
+
+// The last record written to the log and the identical samples since
+// (kept in PersistentState, sealed whenever a flush is committed)
+struct LogRun {
+  bool open;                  // There is a record to repeat
+  uint32_t boot;
+  uint32_t dataCrc;           // CRC of its data columns
+  uint32_t startTick;         // Tick the unwritten repeats follow on from
+  uint32_t lastTick;          // Tick of the latest repeat
+  uint16_t repeats;           // Samples not yet written as an R line
+  uint32_t crc;
+};
+
+uint32_t logRunSamples = 0;        // Samples logged as repeats
+uint32_t logBlocksSkipped = 0;     // Corrupt blocks left out of /api/history
+int32_t logVerifyCorrupt = -1;     // Corrupt blocks found by the last /api/verify (-1 = never run)
 EthernetUDP udp;
 EthernetUDP ntpUDP;
+EthernetUDP snmpUDP;
 MDNS mdns(udp);
-NTPClient timeClient(ntpUDP, NTP_SERVER, 0, NTP_UPDATE_INTERVAL);
+
+// Clock
+uint64_t clockBaseMs = 0;          // UTC milliseconds at clockBaseTick, 0 until the first sync
+uint32_t clockBaseTick = 0;
+bool ntpPending = false;           // Request sent, reply not yet in
+uint32_t ntpRequestTick = 0;       // Also sent as the request's transmit timestamp
+unsigned long lastNtpRequest = 0;
+uint32_t ntpRoundTripMs = 0;
+uint32_t ntpFailures = 0;
+IPAddress ntpServerIP(0, 0, 0, 0); // config.ntpServer as last resolved, 0.0.0.0 if never
+bool ntpServerStale = true;        // Look the server up again before the next request
+
+// Boot and clock mapping
+struct BootRecord {
+  uint32_t id;
+  uint32_t check;             // ~id
+};
+
+struct ClockMapping {
+  uint32_t boot;
+  uint32_t tick;
+  uint64_t epochMs;           // UTC at `tick`, 0 if unknown
+};
+
+uint32_t bootId = 0;
+ClockMapping bootClock = {0, 0, 0};    // This boot's first sync
+ClockMapping cachedClock = {0, 0, 0};  // Last CLOCK.CSV lookup
+uint32_t clockSteps = 0;
 
 // Network settings
-String deviceId = "3572";  // Set your custom device identifier here
 String mdnsHostname = "";
 IPAddress assignedIP;
+byte bootMac[6];   // MAC latched at boot; a new config.mac waits for a restart
+
+struct NetworkStats {
+  uint32_t linkDowns;
+  uint32_t linkDownMs;        // Completed outages only
+  uint32_t dhcpRenewals;      // Successful renewals and rebinds
+  uint32_t dhcpFailures;
+  uint32_t addressChanges;
+  uint32_t mdnsAnnouncements;
+  uint32_t mdnsBusyUs;        // Time spent in the responder (wraps after ~71 minutes of work)
+  uint32_t mdnsDropped;       // Packets discarded when the budget ran out
+  uint32_t mdnsBudgetExhausted;
+};
+
+NetworkStats networkStats;
+bool linkUp = true;
+bool usingDhcp = false;
+uint8_t dhcpFailureStreak = 0;
+unsigned long linkDownSince = 0;
+unsigned long lastNetworkCheck = 0;
+unsigned long lastDhcpAttempt = 0;
 
 // Battery monitoring
 struct Battery {
   int analogPin;
   int rawValue;
+  int32_t millivolts;
   float voltage;
   float percentage;
   bool isHealthy;
+  bool overRange;             // Clamped at full scale: the battery is at or above it
   unsigned long lastUpdate;
 };
 
-Battery batteries[NUM_BATTERIES];
+// Timing of the latest channel scan. The channels are converted back to back
+// with nothing in between, so skewUs (first to last sample) is just the ADC
+// conversion time times the number of channels after the first.
+struct ScanTiming {
+  unsigned long startTick;    // millis() at the first conversion
+  uint32_t startUs;           // micros() at the first conversion
+  uint16_t skewUs;
+  uint16_t maxSkewUs;         // Since boot
+};
+
+struct BankState {
+  int32_t totalMv;
+  int32_t minMv;
+  int32_t maxMv;
+  uint8_t cells;
+  uint8_t faults;             // Cells left out because their channel is faulted
+  uint8_t worst;              // Channel of the lowest cell
+  bool alarm;
+};
+
+struct ChannelFault {
+  uint16_t noiseQ4;           // Smoothed change between scans, ADC codes x 16
+  int16_t lastRaw;            // Previous scan's code, -1 before the first
+  uint8_t fault;              // Confirmed fault (FAULT_*)
+  uint8_t candidate;          // Sign seen on the latest scan
+  uint8_t count;              // Consecutive scans showing the candidate
+  bool pullOpen;              // Latest pull test found the pin floating
+};
+
+struct DropDetector {
+  int32_t baselineQ4;         // Slow average of the channel, mV x 16
+  uint16_t sum;               // CUSUM of the shortfall below the baseline, mV
+  uint8_t scans;              // Scans seen, up to DROP_WARMUP_SCANS
+  bool warning;
+  unsigned long lastEvent;    // millis() of the last detection
+};
+
+Battery batteries[MAX_BATTERIES];
+ScanTiming scanTiming;
+DropDetector dropDetectors[MAX_BATTERIES];
+uint32_t dropEvents = 0;      // Detections since boot
+BankState banks[MAX_BANKS];
+uint32_t bankAlarms = 0;      // Alarms raised since boot
+ChannelFault channelFaults[MAX_BATTERIES];
+uint8_t pullTestChannel = 0;  // Next channel to pull-test
+uint32_t faultEvents = 0;     // Faults raised since boot
+
+// One extended P² estimator. The end markers are the running minimum and
+// maximum; the interior markers sit at QUANTILE_TARGETS. Until nine
+// observations are in, minMv, maxMv and height hold them unsorted.
+struct ChannelQuantiles {
+  uint16_t samples;           // Observations today (none while the channel is faulted)
+  uint16_t minMv;
+  uint16_t maxMv;
+  uint16_t height[QUANTILE_MARKERS];    // mV at each interior marker
+  uint16_t position[QUANTILE_MARKERS];  // 1-based observation rank of each interior marker
+};
+
+ChannelQuantiles quantiles[MAX_BATTERIES];
+uint16_t statsSamples = 0;    // Sampling passes today
+uint16_t statsDay = 0;        // Local day being summarised, 0 until the clock is set
+unsigned long lastStatsSample = 0;
+uint16_t yesterdayDay = 0;    // Last finished day, 0 if none since boot
+uint16_t yesterdaySamples = 0;
+bool dailySummaryPending = false; // The finished day is still to be appended to DAILY_SUMMARY_FILE
 unsigned long lastLogTime = 0;
 unsigned long lastDisplayUpdate = 0;
 int currentDisplayBattery = 0;
@@ -58,29 +553,496 @@ const int GREEN_LED = 13;
 bool ledState = false;
 unsigned long lastLedUpdate = 0;
 
+// Request accounting
+enum Route {
+  ROUTE_DASHBOARD,
+  ROUTE_CURRENT,
+  ROUTE_HISTORY,
+  ROUTE_ACCESS,
+  ROUTE_METRICS,
+  ROUTE_CONFIG,
+  ROUTE_CALIBRATE,
+  ROUTE_VERIFY,
+  ROUTE_STATS,
+  ROUTE_TRACE,
+  ROUTE_NOT_FOUND,
+  ROUTE_COUNT
+};
+// Route names live in flash; print them with routeName()
+const char ROUTE_NAME_DASHBOARD[] PROGMEM = "/";
+const char ROUTE_NAME_CURRENT[] PROGMEM = "/api/current";
+const char ROUTE_NAME_HISTORY[] PROGMEM = "/api/history";
+const char ROUTE_NAME_ACCESS[] PROGMEM = "/api/access";
+const char ROUTE_NAME_METRICS[] PROGMEM = "/metrics";
+const char ROUTE_NAME_CONFIG[] PROGMEM = "/api/config";
+const char ROUTE_NAME_CALIBRATE[] PROGMEM = "/api/calibrate";
+const char ROUTE_NAME_VERIFY[] PROGMEM = "/api/verify";
+const char ROUTE_NAME_STATS[] PROGMEM = "/api/stats";
+const char ROUTE_NAME_TRACE[] PROGMEM = "/api/trace";
+const char ROUTE_NAME_OTHER[] PROGMEM = "other";
+const char* const ROUTE_NAMES[ROUTE_COUNT] PROGMEM = {
+  ROUTE_NAME_DASHBOARD, ROUTE_NAME_CURRENT, ROUTE_NAME_HISTORY, ROUTE_NAME_ACCESS, ROUTE_NAME_METRICS, ROUTE_NAME_CONFIG,
+  ROUTE_NAME_CALIBRATE, ROUTE_NAME_VERIFY, ROUTE_NAME_STATS, ROUTE_NAME_TRACE, ROUTE_NAME_OTHER
+};
+
+// mDNS TXT record for the HTTP service, sized from its contents. Each string
+// takes a length byte plus its text, so a flash string's sizeof covers it.
+// api= lists every route but the dashboard and the catch-all (and the trace
+// when it is compiled out); each name's terminator pays for its comma.
+const char MDNS_TXT_VERSION[] PROGMEM = "txtvers=1";
+const char MDNS_TXT_PATH[] PROGMEM = "path=/";
+const char MDNS_TXT_FORMATS[] PROGMEM = "formats=json,prometheus";
+const uint8_t MDNS_TXT_API_MAX = sizeof("api=") + sizeof(ROUTE_NAME_CURRENT) + sizeof(ROUTE_NAME_HISTORY) +
+    sizeof(ROUTE_NAME_ACCESS) + sizeof(ROUTE_NAME_METRICS) + sizeof(ROUTE_NAME_CONFIG) +
+    sizeof(ROUTE_NAME_CALIBRATE) + sizeof(ROUTE_NAME_VERIFY) + sizeof(ROUTE_NAME_STATS) +
+    (TRACE_ENABLED ? sizeof(ROUTE_NAME_TRACE) : 0) - 1;
+const uint8_t MDNS_TXT_MAX = sizeof(MDNS_TXT_VERSION) + sizeof(MDNS_TXT_PATH) + sizeof(MDNS_TXT_FORMATS) +
+    sizeof("id=") + sizeof(DeviceConfig::deviceId) - 1 + MDNS_TXT_API_MAX + 1; // + terminator
+char mdnsTxt[MDNS_TXT_MAX];
+
+// Upper bounds of the latency histogram buckets in milliseconds (+Inf is implicit)
+const uint16_t LATENCY_BUCKETS_MS[] PROGMEM = {10, 50, 250, 1000, 5000};
+const uint8_t LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS_MS) / sizeof(LATENCY_BUCKETS_MS[0]);
+const uint8_t ACCESS_LOG_SIZE = 8; // Most recent requests kept for /api/access
+
+struct AccessRecord {
+  uint32_t clientIP;
+  unsigned long startTime;
+  uint32_t bytesSent;
+  uint16_t ttfbMs;
+  uint16_t durationMs;
+  uint16_t status;
+  uint8_t route;
+};
+
+struct RouteStats {
+  uint32_t buckets[LATENCY_BUCKET_COUNT + 1]; // Per-bucket (non-cumulative) counts
+  uint32_t count;
+  uint32_t durationMsSum;
+  uint32_t ttfbMsSum;
+  uint32_t bytesSent;
+};
+
+// Rate limiting: one token bucket per client IP. Routes cost tokens in
+// proportion to the work they cause, so a history poller runs dry long before
+// a dashboard polling /api/current does.
+const uint8_t RATE_LIMIT_CLIENTS = 8;            // Client IPs tracked at once
+const uint32_t RATE_LIMIT_BURST = 20;            // Bucket capacity in tokens
+const uint32_t RATE_LIMIT_TOKENS_PER_SEC = 2;    // Sustained refill rate
+const uint8_t ROUTE_COST[ROUTE_COUNT] = {
+  2,  // Dashboard
+  1,  // /api/current
+  10, // /api/history (SD scan)
+  1,  // /api/access
+  1,  // /metrics
+  2,  // /api/config
+  2,  // /api/calibrate
+  10, // /api/verify (SD scan)
+  1,  // /api/stats
+  2,  // /api/trace
+  1   // Not found
+};
+
+struct RateBucket {
+  uint32_t clientIP;          // 0 = unused slot
+  uint32_t milliTokens;       // Tokens x 1000
+  unsigned long lastRefill;
+};
+
+RateBucket rateBuckets[RATE_LIMIT_CLIENTS];
+
+AccessRecord accessLog[ACCESS_LOG_SIZE];
+uint8_t accessLogNext = 0;
+uint32_t accessLogTotal = 0; // Since boot; the ring itself is not preserved across resets
+
+// State preserved across warm resets (watchdog, brownout, external reset).
+// It lives in .noinit so the C runtime does not clear it, and every block
+// carries its own CRC32, resealed each time the block changes, so a reset
+// in the middle of an update invalidates only that block. On a power-on
+// reset, or if a block fails its check, it starts from zero. Only what is
+// needed to log without gaps is kept; the request statistics restart.
+const uint32_t PERSISTENT_MAGIC = 0xB7A5E001; // Combined with the layout size below
+const uint8_t SAMPLE_RING_SIZE = 3; // Log records held until written to the SD card
+
+struct RuntimeCounters {
+  uint32_t requests;          // HTTP requests completed
+  uint32_t rateLimited;       // Requests rejected with 429
+  uint32_t logRecords;        // Records written to the SD card
+  uint32_t logRecordsDropped; // Samples lost to ring overflow or corruption
+  uint32_t warmResets;        // Resets survived with this state intact
+  uint32_t crc;
+};
+
+// ADC codes are 10 bits: the top 8 are kept in rawHigh, the low 2 bits of
+// four channels share a byte of rawLow
+struct SampleRecord {
+  uint64_t epochMs;           // UTC milliseconds, 0 before the first NTP sync
+  uint32_t boot;
+  uint32_t tick;              // millis() when taken
+  uint8_t rawHigh[MAX_BATTERIES];
+  uint8_t rawLow[MAX_BATTERIES / 4];
+  uint16_t avccMv;            // ADC reference when taken
+  uint16_t cal;               // Calibration generation when taken
+  uint8_t numBatteries;
+  uint32_t crc;
+};
+
+struct SampleRing {
+  uint8_t head;               // Oldest pending record
+  uint8_t count;              // Records not yet on the SD card
+  uint32_t crc;
+};
+
+struct PersistentState {
+  uint32_t magic;
+  RuntimeCounters counters;
+  SampleRing ring;
+  SampleRecord samples[SAMPLE_RING_SIZE];
+  LogRun logRun;
+};
+
+PersistentState persistent __attribute__((section(".noinit")));
+RuntimeCounters& counters = persistent.counters;
+LogRun& logRun = persistent.logRun;
+RouteStats routeStats[ROUTE_COUNT];  // Since boot
+
+template <typename T> uint32_t blockCrc(const T& block) {
+  return crc32Update(0, &block, sizeof(T) - sizeof(block.crc));
+}
+
+template <typename T> void sealBlock(T& block) {
+  block.crc = blockCrc(block);
+}
+
+template <typename T> bool isBlockSealed(const T& block) {
+  return block.crc == blockCrc(block);
+}
+
+// EthernetClient that counts response bytes and remembers when the first one
+// went out, so every send function is metered without changing its code.
+class MeteredClient : public EthernetClient {
+public:
+  MeteredClient() : bytesSent(0), firstByteTime(0) {}
+  MeteredClient(const EthernetClient& client) : EthernetClient(client), bytesSent(0), firstByteTime(0) {}
+
+  using EthernetClient::write;
+
+  size_t write(uint8_t b) override {
+    return write(&b, 1);
+  }
+
+  size_t write(const uint8_t* buf, size_t size) override {
+    if (bytesSent == 0 && size > 0) firstByteTime = millis();
+    size_t written = EthernetClient::write(buf, size);
+    bytesSent += written;
+    return written;
+  }
+
+  uint32_t bytesSent;
+  unsigned long firstByteTime;
+};
+
+// Splits the log into blocks while reading it. Record bytes go into the
+// running CRC; a line starting with '#' is the block's trailer and is parsed
+// a character at a time, so no line buffer is needed. The trailer's second
+// field is the CRC, '-' for an unchecked tail sealed at boot, or 'x' for the
+// fragment of a failed write, which readers discard.
+enum LogScanState { SCAN_LINE_START, SCAN_RECORD, SCAN_TRAILER_SEQ, SCAN_TRAILER_CRC };
+enum LogBlockResult { BLOCK_NONE, BLOCK_VALID, BLOCK_CORRUPT, BLOCK_UNSEALED, BLOCK_VOID, BLOCK_END };
+
+struct LogBlockScanner {
+  uint32_t crc;            // CRC of the record bytes seen so far
+  uint32_t bytes;          // Record bytes seen so far
+  uint32_t trailerSeq;
+  uint32_t trailerCrc;
+  uint8_t state;
+  bool unsealed;           // Trailer written at boot for an unchecked tail
+  bool voided;             // Trailer written after a failed write
+  bool malformed;
+};
+
+struct LogBlockStats {
+  uint16_t valid;
+  uint16_t corrupt;
+  uint16_t unsealed;
+  uint16_t voided;
+  uint16_t sequenceGaps;
+  uint32_t nextSeq;
+};
+
+// HTTP connection scheduling. Connections are accepted into a fixed set of
+// slots and read without blocking; complete requests are then served by
+// priority class. Real-time routes are answered in full as soon as they are
+// ready, while bulk routes are streamed a chunk at a time and yield to any
+// real-time request at every chunk boundary.
+enum HttpState { HTTP_FREE, HTTP_READING, HTTP_READY, HTTP_STREAMING };
+enum Priority { PRIORITY_REALTIME, PRIORITY_BULK };
+const uint8_t ROUTE_PRIORITY[ROUTE_COUNT] = {
+  PRIORITY_REALTIME, // Dashboard
+  PRIORITY_REALTIME, // /api/current
+  PRIORITY_BULK,     // /api/history
+  PRIORITY_REALTIME, // /api/access
+  PRIORITY_REALTIME, // /metrics
+  PRIORITY_REALTIME, // /api/config
+  PRIORITY_REALTIME, // /api/calibrate
+  PRIORITY_BULK,     // /api/verify
+  PRIORITY_REALTIME, // /api/stats
+  PRIORITY_REALTIME, // /api/trace
+  PRIORITY_REALTIME  // Not found
+};
+
+const uint8_t HTTP_MAX_CONNECTIONS = 2;            // Concurrent clients (W5500 has 8 sockets)
+const uint8_t HTTP_REQUEST_LINE_MAX = 64;          // Longest request line kept
+const unsigned long HTTP_REQUEST_TIMEOUT = 2000;   // Drop clients that hold the request line this long
+const uint8_t HISTORY_CHUNK_RECORDS = 4;           // Log records streamed per bulk chunk
+const int HISTORY_CHUNK_MIN_SPACE = 512;           // Skip clients whose TX buffer is this full
+const unsigned long BULK_TICK_BUDGET = 40;         // ms of bulk streaming per loop pass
+
+struct HttpConnection {
+  MeteredClient client;
+  uint8_t state;
+  uint8_t route;
+  uint16_t status;
+  uint32_t clientIP;
+  unsigned long startTime;
+  File file;               // Log file being streamed
+  bool firstRecord;
+  LogBlockScanner scanner; // Verifies each log block before it is used
+  LogBlockStats blocks;
+  uint32_t blockStart;     // File offset of the block being checked or sent
+  uint32_t blockEnd;       // End of its records once verified, 0 while checking
+  unsigned long scanStart;
+  uint16_t segment;        // Log segment being read
+  uint8_t logFormat;       // LOG_FORMAT_* columns of that segment
+  uint32_t scanBytes;      // Bytes of finished segments
+  bool isoTimes;           // History: ISO-8601 timestamps requested (?format=iso)
+  uint8_t logBatteries;    // Battery columns in the segment's header
+  uint32_t lastRecordPos;  // History: file offset of the last record sent, 0 if none
+  uint16_t repeatsLeft;    // Repeats of that record still to send (R lines)
+  uint32_t repeatInterval;
+  uint32_t repeatShift;    // ms added to the record's times for the latest repeat
+  uint32_t lastBoot;       // History: boot and tick of the newest record sent, 0 if none
+  uint32_t lastTick;
+};
+
+HttpConnection httpConnections[HTTP_MAX_CONNECTIONS];
+uint8_t nextBulkSlot = 0;
+
+// One request line buffer, lent to a connection from the moment it starts
+// reading until its handler has parsed the query. Other connections wait,
+// with their bytes left in the socket buffer.
+char httpRequestLine[HTTP_REQUEST_LINE_MAX];
+HttpConnection* httpRequestLineOwner = NULL;
+unsigned long httpRequestLineSince; // When the owner got the buffer
+uint8_t httpRequestLength;
+bool httpRequestLineDone;
+uint32_t httpHeaderTail;   // Last four bytes received, to spot the blank line
+
 // Function declarations
 void readBatteries();
 void updateDisplay();
 void updateStatusLEDs(unsigned long currentTime);
-void logBatteryData(unsigned long timestamp);
+void logBatteryData();
 void handleWebRequests();
 void sendDashboard(EthernetClient& client);
 void sendCurrentData(EthernetClient& client);
-void sendHistoryData(EthernetClient& client);
+void beginHistoryData(HttpConnection& conn);
+bool continueHistoryData(HttpConnection& conn);
+void sendHistoryRecord(EthernetClient& client, const String& line, uint8_t format, uint8_t batteries, bool isoTimes, uint32_t shiftMs);
+void resetHistoryRepeats(HttpConnection& conn);
+bool historyRecordIsCopy(HttpConnection& conn, const String& line, uint32_t shiftMs);
+void beginLogVerify(HttpConnection& conn);
+bool continueLogVerify(HttpConnection& conn);
 void send404(EthernetClient& client);
+void send429(EthernetClient& client, uint16_t retryAfter);
+void send503(EthernetClient& client);
+uint8_t classifyRoute(const char* requestLine);
+void acceptHttpConnections();
+void pollHttpRequests();
+bool serveRealtimeRequests();
+HttpConnection* nextBulkConnection();
+bool bulkSlotFree(const HttpConnection& conn);
+void closeHttpConnection(HttpConnection& conn);
+void releaseRequestLine(HttpConnection& conn);
+bool admitRequest(uint32_t clientIP, uint8_t route, uint16_t& retryAfter);
+void sendAccessLog(EthernetClient& client);
+void sendMetrics(EthernetClient& client);
+void recordAccess(MeteredClient& client, uint32_t clientIP, uint8_t route, uint16_t status, unsigned long startTime);
+const __FlashStringHelper* routeName(uint8_t route);
+
+// Configuration function declarations
+void loadConfig();
+void setDefaultConfig(DeviceConfig& cfg);
+bool parseConfigJson(JsonDocument& doc, DeviceConfig& cfg, const __FlashStringHelper*& error);
+void writeConfigJson(Print& out, const DeviceConfig& cfg);
+void saveConfig(const DeviceConfig& cfg);
+void applyConfig(const DeviceConfig& previous);
+void handleConfigRequest(HttpConnection& conn);
+uint32_t crc32Update(uint32_t crc, const void* data, size_t length);
+
+// Calibration function declarations
+void loadCalibration();
+void updateEffectiveGains();
+void measureAvcc();
+void resetCalibration(uint8_t channel);
+const __FlashStringHelper* captureCalibrationPoint(uint8_t channel, uint8_t point, int32_t millivolts);
+void handleCalibrationRequest(HttpConnection& conn);
+void writeCalibrationJson(Print& out);
+void handleSerialCommands();
+bool getQueryParam(const char* requestLine, PGM_P name, char* value, size_t size);
+
+// SNMP function declarations
+void handleSnmpRequests();
 
 // Time function declarations
 String getUTCTimeString();
 String getLocalTimeString();
 String getUSLocalTimeString();
-String getDateTimeForCSV();
+String getDateTimeForCSV(uint64_t epochMs);
 void initializeNTP();
+void updateClock();
+void sendNtpRequest();
+bool receiveNtpReply();
+bool clockIsSet();
+uint64_t epochMillis();
 unsigned long getUTCTimestamp();
 
+// Boot id and clock mapping function declarations
+void loadBootId();
+void noteClockSync(bool first, int32_t stepMs);
+bool findClockMapping(uint32_t boot, ClockMapping& mapping);
+uint64_t epochFromTick(const ClockMapping& mapping, uint32_t tick);
+uint64_t parseUint64(const char* text, char** end);
+uint64_t parseIsoTimestamp(const char* text);
+
+// Network supervisor function declarations
+void superviseNetwork(unsigned long now);
+bool requestDhcpAddress();
+void useFallbackAddress();
+void checkAddressChange();
+bool startMdns();
+bool buildMdnsTxt();
+bool appendMdnsTxt(uint8_t& length, PGM_P text, const char* suffix);
+void runMdnsTask();
+
+// Watchdog function declarations
+void initWatchdog();
+void beginTask(uint8_t task);
+void endTask(uint8_t task);
+void feedWatchdog();
+
+// Persistent state function declarations
+void restorePersistentState();
+void queueSample(uint64_t epochMs);
+void flushSamples();
+uint16_t recordRaw(const SampleRecord& record, uint8_t channel);
+size_t writeLogRecordData(Print& out, const SampleRecord& record);
+size_t writeLogRun(Print& out);
+void closeLogRun();
+int32_t rawToMillivolts(uint8_t channel, int raw);
+int32_t rawToMillivoltsAt(uint8_t channel, int raw, int32_t avccMv);
+float millivoltsToPercentage(int32_t millivolts);
+
+// Bank function declarations
+uint8_t bankCount();
+void resetBanks(BankState* states);
+void addBankCell(BankState* states, uint8_t channel, int32_t millivolts);
+void checkBankAlarms();
+
+// Drop detection function declarations
+void updateDropDetector(uint8_t channel, int32_t millivolts, unsigned long now);
+void resetDropDetectors();
+
+// Channel fault function declarations
+void resetChannelFault(uint8_t channel);
+bool pullTestOpen(uint8_t channel, int raw);
+void updateChannelFault(uint8_t channel, int raw);
+bool anyChannelFault();
+
+// Daily statistics function declarations
+void updateDailyStats(unsigned long now);
+void addQuantileObservation(ChannelQuantiles& q, uint16_t count, uint16_t millivolts);
+void adjustQuantileMarkers(ChannelQuantiles& q, uint16_t count);
+uint16_t dailyStatMillivolts(const ChannelQuantiles& q, uint16_t count, uint8_t which);
+void closeStatsDay();
+void writeDailySummary();
+void formatDay(uint16_t day, char* text);
+void sendStats(EthernetClient& client);
+void sendTrace(EthernetClient& client);
+void sendStatsDayHeader(EthernetClient& client, uint16_t day, uint16_t samples);
+void sendStatsYesterday(EthernetClient& client);
+
+// Log recovery and integrity function declarations
+void recoverLogTail();
+int32_t findLineStart(SdFile& file, uint32_t end);
+void sealLogTail(SdFile& log, uint32_t end);
+void writeLogTrailer(Print& out, uint32_t crc);
+void resetLogBlockScanner(LogBlockScanner& scanner);
+uint16_t scanLogBlock(LogBlockScanner& scanner, const uint8_t* data, uint16_t length, uint8_t& result);
+uint8_t scanLogChunk(File& file, LogBlockScanner& scanner);
+void countLogBlock(LogBlockStats& stats, const LogBlockScanner& scanner, uint8_t result);
+
+// Log segment and SD space function declarations
+void logSegmentName(uint16_t segment, char* name);
+void findLogSegments();
+bool startLogSegment(uint16_t segment);
+void writeLogHeader(Print& out);
+uint32_t logHeaderCrc();
+uint8_t readLogHeader(File& file, uint32_t& crc, uint8_t& batteries);
+File openLogSegment(uint16_t& segment, uint8_t& format, uint8_t& batteries);
+bool openNextLogSegment(HttpConnection& conn);
+uint32_t clustersFor(uint32_t bytes);
+void accountFileGrowth(uint32_t before, uint32_t after);
+void startFreeSpaceScan();
+void continueFreeSpaceScan();
+void pruneLogSegments();
+size_t printUint64(Print& out, uint64_t value);
+
+// Print sink that discards everything (with CrcPrint, checksums output)
+class NullPrint : public Print {
+public:
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t size) override { return size; }
+};
+
+// Print adapter that folds everything written through it into a CRC32
+class CrcPrint : public Print {
+public:
+  CrcPrint(Print& out) : out(out), crc(0) {}
+
+  using Print::write;
+
+  size_t write(uint8_t b) override {
+    return write(&b, 1);
+  }
+
+  size_t write(const uint8_t* buf, size_t size) override {
+    size_t written = out.write(buf, size);
+    crc = crc32Update(crc, buf, written);
+    return written;
+  }
+
+  Print& out;
+  uint32_t crc;
+};
+
+// Runs before main(): saves the reset cause and stops a watchdog left
+// running across the reset from firing again during setup()
+void captureResetFlags() __attribute__((naked, used, section(".init3")));
+void captureResetFlags() {
+  resetFlags = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
+}
+
 void setup() {
   Serial.begin(9600);
   while (!Serial) { ; }
 
+  initWatchdog();
+  restorePersistentState();
+  loadBootId();
+
   // Initialize LEDs
   pinMode(RED_LED, OUTPUT);
   pinMode(GREEN_LED, OUTPUT);
@@ -91,116 +1053,153 @@ void setup() {
   lcd.init();
   lcd.backlight();
   lcd.setCursor(0, 0);
-  lcd.print("Battery Monitor");
+  lcd.print(F("Battery Monitor"));
   lcd.setCursor(0, 1);
-  lcd.print("Initializing...");
-
-  // Initialize battery structures
-  for (int i = 0; i < NUM_BATTERIES; i++) {
-    batteries[i].analogPin = ANALOG_PINS[i];
-    batteries[i].rawValue = 0;
-    batteries[i].voltage = 0.0;
-    batteries[i].percentage = 0.0;
-    batteries[i].isHealthy = true;
-    batteries[i].lastUpdate = 0;
-  }
+  lcd.print(F("Initializing..."));
 
   // Initialize SD card with detailed diagnostics
-  Serial.print("Initializing SD card on CS pin ");
+  Serial.print(F("Initializing SD card on CS pin "));
   Serial.print(SD_CS_PIN);
-  Serial.print("...");
+  Serial.print(F("..."));
 
   lcd.setCursor(0, 1);
-  lcd.print("Init SD card... ");
+  lcd.print(F("Init SD card... "));
 
   if (!SD.begin(SD_CS_PIN)) {
-    Serial.println(" FAILED!");
-    Serial.println("SD card troubleshooting:");
-    Serial.println("1. Check card is inserted properly");
-    Serial.println("2. Check card is formatted (FAT16/FAT32)");
-    Serial.println("3. Check wiring to CS pin 4");
-    Serial.println("4. Try different SD card");
+    Serial.println(F(" FAILED!"));
+    Serial.println(F("SD card troubleshooting:"));
+    Serial.println(F("1. Check card is inserted properly"));
+    Serial.println(F("2. Check card is formatted (FAT16/FAT32)"));
+    Serial.println(F("3. Check wiring to CS pin 4"));
+    Serial.println(F("4. Try different SD card"));
 
     lcd.setCursor(0, 1);
-    lcd.print("SD Card Failed! ");
+    lcd.print(F("SD Card Failed! "));
     delay(3000);
+
+    // No config.json without a card; EEPROM or defaults still apply
+    loadConfig();
   } else {
-    Serial.println(" Success!");
+    Serial.println(F(" Success!"));
 
     // Test SD card read/write capability
-    Serial.print("Testing SD card write access...");
+    Serial.print(F("Testing SD card write access..."));
     File testFile = SD.open("test.txt", FILE_WRITE);
     if (testFile) {
-      testFile.println("SD test");
+      testFile.println(F("SD test"));
       testFile.close();
-      Serial.println(" Write OK");
+      Serial.println(F(" Write OK"));
       SD.remove("test.txt"); // Clean up test file
     } else {
-      Serial.println(" Write FAILED!");
-      Serial.println("SD card is read-only or corrupted");
+      Serial.println(F(" Write FAILED!"));
+      Serial.println(F("SD card is read-only or corrupted"));
     }
 
+    // Load the device configuration before anything depends on it
+    loadConfig();
+
+    // Drop any record torn by a power cut during the last write
+    sdRawReady = sdCard.init(SPI_HALF_SPEED, SD_CS_PIN) && sdVolume.init(&sdCard);
+    findLogSegments();
+    recoverLogTail();
+    startFreeSpaceScan();
+
+    // Write out the repeats of a run left open by a warm reset, right after
+    // the record they repeat; samples from this boot start a new run anyway
+    if (!SD.exists(logFileName)) logRun.repeats = 0; // Its record went with the file
+    closeLogRun();
+
     // Create header in log file if it doesn't exist
-    if (!SD.exists("battery.csv")) {
-      Serial.print("Creating new log file...");
-      File logFile = SD.open("battery.csv", FILE_WRITE);
-      if (logFile) {
-        logFile.print("DateTime_UTC,");
-        for (int i = 0; i < NUM_BATTERIES; i++) {
-          logFile.print("Battery");
-          logFile.print(i + 1);
-          logFile.print("_Raw,Battery");
-          logFile.print(i + 1);
-          logFile.print("_Voltage,Battery");
-          logFile.print(i + 1);
-          logFile.print("_Percentage");
-          if (i < NUM_BATTERIES - 1) logFile.print(",");
-        }
-        logFile.println();
-        logFile.close();
-        Serial.println(" Success!");
+    if (!SD.exists(logFileName)) {
+      Serial.print(F("Creating new log file..."));
+      if (startLogSegment(activeLogSegment)) {
+        Serial.println(F(" Success!"));
       } else {
-        Serial.println(" FAILED!");
-        Serial.println("Cannot create log file - check SD card");
+        Serial.println(F(" FAILED!"));
+        Serial.println(F("Cannot create log file - check SD card"));
       }
     } else {
-      Serial.println("Log file already exists");
+      File logFile = SD.open(logFileName);
+      activeLogSize = logFile.size();
+      uint8_t columns;
+      readLogHeader(logFile, activeHeaderCrc, columns);
+      logFile.close();
+      Serial.print(F("Log file already exists: "));
+      Serial.println(logFileName);
+
+      // Columns differ (battery count or firmware change): start afresh
+      if (activeHeaderCrc != logHeaderCrc()) {
+        Serial.println(F("Log columns changed, starting a new segment"));
+        startLogSegment(activeLogSegment + 1);
+      }
     }
 
+    // Write out samples that were still pending when the last reset hit
+    flushSamples();
+
     lcd.setCursor(0, 1);
-    lcd.print("SD Card Ready!  ");
+    lcd.print(F("SD Card Ready!  "));
     delay(1000);
   }
 
+  Serial.print(F("Configuration loaded from "));
+  Serial.println(configSource);
+
+  loadCalibration();
+
+  // Initialize battery structures (all channels, so numBatteries can grow at runtime)
+  for (int i = 0; i < MAX_BATTERIES; i++) {
+    batteries[i].analogPin = ANALOG_PINS[i];
+    batteries[i].rawValue = 0;
+    batteries[i].millivolts = 0;
+    batteries[i].voltage = 0.0;
+    batteries[i].percentage = 0.0;
+    batteries[i].isHealthy = true;
+    batteries[i].overRange = false;
+    batteries[i].lastUpdate = 0;
+    resetChannelFault(i);
+  }
+
   // Set mDNS hostname using custom device ID
-  mdnsHostname = "battery-monitor-" + deviceId;
+  mdnsHostname = String(F("battery-monitor-")) + config.deviceId;
 
   // Initialize Ethernet with DHCP
-  Serial.print("Getting IP via DHCP...");
+  memcpy(bootMac, config.mac, sizeof(bootMac));
+  Serial.print(F("Getting IP via DHCP..."));
   lcd.setCursor(0, 1);
-  lcd.print("Getting IP...   ");
+  lcd.print(F("Getting IP...   "));
 
-  if (Ethernet.begin(mac) == 0) {
-    Serial.println("DHCP failed! Using fallback IP");
-    IPAddress fallbackIP(192, 168, 1, 177);
-    Ethernet.begin(mac, fallbackIP);
+  // Short attempts keep later lease renewals within the watchdog period
+  for (uint8_t attempt = 0; attempt < DHCP_BOOT_ATTEMPTS && !usingDhcp; attempt++) {
+    usingDhcp = requestDhcpAddress();
+  }
+  if (!usingDhcp) {
+    Serial.println(F("DHCP failed! Using fallback IP"));
+    useFallbackAddress();
   }
+  lastDhcpAttempt = millis();
+  linkUp = Ethernet.linkStatus() != LinkOFF;
 
   assignedIP = Ethernet.localIP();
-  Serial.print("IP address: ");
+  Serial.print(F("IP address: "));
   Serial.println(assignedIP);
 
   // Start web server
   server.begin();
 
+  // Start SNMP agent
+  snmpUDP.begin(SNMP_PORT);
+  Serial.print(F("SNMP agent listening on UDP port "));
+  Serial.println(SNMP_PORT);
+
   // Initialize mDNS
-  Serial.print("Starting mDNS as: ");
+  Serial.print(F("Starting mDNS as: "));
   Serial.print(mdnsHostname);
-  Serial.println(".local");
+  Serial.println(F(".local"));
 
-  if (mdns.begin(assignedIP, mdnsHostname.c_str())) {
-    mdns.addServiceRecord(mdnsHostname.c_str(), 80, MDNSServiceTCP, "\\x0dBattery Monitor");
-    Serial.println("mDNS responder started");
+  if (!buildMdnsTxt()) Serial.println(F("mDNS TXT record too long; trailing entries left out"));
+  if (startMdns()) {
+    Serial.println(F("mDNS responder started"));
 
     lcd.setCursor(0, 1);
     lcd.print(mdnsHostname.substring(0, 16));
@@ -210,9 +1209,9 @@ void setup() {
     lcd.print(assignedIP);
     delay(2000);
   } else {
-    Serial.println("mDNS failed to start");
+    Serial.println(F("mDNS failed to start"));
     lcd.setCursor(0, 1);
-    lcd.print("mDNS Failed!    ");
+    lcd.print(F("mDNS Failed!    "));
     delay(2000);
   }
 
@@ -220,411 +1219,4298 @@ void setup() {
   initializeNTP();
 
   lcd.setCursor(0, 1);
-  lcd.print("Ready!          ");
+  lcd.print(F("Ready!          "));
   delay(1000);
+
+  // Setup is done with its long blocking steps; start supervising the loop
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < TASK_COUNT; i++) taskLastCheckIn[i] = now;
+  wdt_enable(WDTO_8S);
 }
 
 void loop() {
   unsigned long currentTime = millis();
 
-  // Process mDNS
-  mdns.run();
+  beginTask(TASK_NETWORK);
+
+  // Watch the link and keep the DHCP lease alive
+  superviseNetwork(currentTime);
+
+  // Answer mDNS queries within a fixed time budget
+  runMdnsTask();
 
-  // Update NTP client
-  timeClient.update();
+  // Keep the clock in step with NTP
+  TRACE_BEGIN(TRACE_NTP_UPDATE, ntpPending);
+  updateClock();
+  TRACE_END(TRACE_NTP_UPDATE, ntpPending);
+
+  endTask(TASK_NETWORK);
+  beginTask(TASK_SAMPLING);
 
   // Read battery values
+  TRACE_BEGIN(TRACE_READ_BATTERIES, config.numBatteries);
   readBatteries();
+  TRACE_END(TRACE_READ_BATTERIES, config.numBatteries);
 
   // Update display
-  if (currentTime - lastDisplayUpdate >= DISPLAY_UPDATE) {
+  if (currentTime - lastDisplayUpdate >= config.displayUpdate) {
     updateDisplay();
     lastDisplayUpdate = currentTime;
   }
 
+  // Daily percentiles
+  updateDailyStats(currentTime);
+
   // Update status LEDs
   updateStatusLEDs(currentTime);
 
+  // Serial console (calibration)
+  handleSerialCommands();
+
+  endTask(TASK_SAMPLING);
+  beginTask(TASK_LOGGING);
+
   // Log data to SD card
-  if (currentTime - lastLogTime >= LOG_INTERVAL) {
-    logBatteryData(currentTime);
+  if (currentTime - lastLogTime >= config.logInterval) {
+    TRACE_BEGIN(TRACE_LOG_DATA, persistent.ring.count);
+    logBatteryData();
+    TRACE_END(TRACE_LOG_DATA, persistent.ring.count);
     lastLogTime = currentTime;
   }
 
+  // Append the day that has just ended to the daily summary
+  if (dailySummaryPending) writeDailySummary();
+
+  // Count free SD space in the background after boot
+  continueFreeSpaceScan();
+
+  endTask(TASK_LOGGING);
+  beginTask(TASK_NETWORK);
+
   // Handle web requests
+  TRACE_BEGIN(TRACE_WEB_REQUESTS, 0);
   handleWebRequests();
+  TRACE_END(TRACE_WEB_REQUESTS, 0);
+
+  // Answer SNMP queries
+  handleSnmpRequests();
+
+  endTask(TASK_NETWORK);
+
+  feedWatchdog();
 
   delay(100);
 }
 
-void readBatteries() {
-  for (int i = 0; i < NUM_BATTERIES; i++) {
-    batteries[i].rawValue = analogRead(batteries[i].analogPin);
-    // Calculate actual voltage based on voltage divider
-    // Assumes voltage divider scales battery voltage to Arduino's 0-5V range
-    float scaledVoltage = (batteries[i].rawValue * ARDUINO_REF_VOLTAGE) / 1023.0;
-    batteries[i].voltage = scaledVoltage * (BATTERY_VOLTAGE_MAX / ARDUINO_REF_VOLTAGE);
-
-    // Calculate percentage based on typical 12V battery range (10V=0%, 12.6V=100%)
-    float minVoltage = BATTERY_VOLTAGE_MAX * 0.83; // 10V for 12V battery
-    float maxVoltage = BATTERY_VOLTAGE_MAX * 1.05; // 12.6V for 12V battery
-    batteries[i].percentage = constrain(map(batteries[i].voltage * 100, minVoltage * 100, maxVoltage * 100, 0, 100), 0, 100);
+// Applies the channel's divider calibration (AVCC-corrected) in Q16 fixed point
+int32_t rawToMillivolts(uint8_t channel, int raw) {
+  int32_t millivolts = ((int32_t)raw * effectiveGainQ16[channel] + calibration.channels[channel].offsetQ16) >> 16;
+  return millivolts > 0 ? millivolts : 0;
+}
 
-    // Consider below 20% (approximately 10.5V for 12V battery) as unhealthy
-    batteries[i].isHealthy = batteries[i].percentage > 20;
-    batteries[i].lastUpdate = millis();
+// The same conversion for a reading taken at another AVCC, as when logging
+// queued samples or rebuilding raw-only records
+int32_t rawToMillivoltsAt(uint8_t channel, int raw, int32_t avccMv) {
+  int32_t gainQ16 = calibration.channels[channel].gainQ16;
+  if (calibration.compensated & (1U << channel)) {
+    int32_t scaleQ16 = (avccMv << 16) / NOMINAL_AVCC_MV;
+    gainQ16 = ((int64_t)gainQ16 * scaleQ16) >> 16;
   }
+  int32_t millivolts = ((int32_t)raw * gainQ16 + calibration.channels[channel].offsetQ16) >> 16;
+  return millivolts > 0 ? millivolts : 0;
 }
 
-void updateDisplay() {
-  lcd.clear();
-  lcd.setCursor(0, 0);
-  lcd.print("Bat");
-  lcd.print(currentDisplayBattery + 1);
-  lcd.print(": ");
-  lcd.print(batteries[currentDisplayBattery].voltage, 2);
-  lcd.print("V");
-
-  lcd.setCursor(0, 1);
-  lcd.print(batteries[currentDisplayBattery].percentage);
-  lcd.print("% ");
-  lcd.print(batteries[currentDisplayBattery].isHealthy ? "OK" : "LOW");
-
-  // Cycle through batteries
-  currentDisplayBattery = (currentDisplayBattery + 1) % NUM_BATTERIES;
+// Percentage based on typical 12V battery range (10V=0%, 12.6V=100%)
+float millivoltsToPercentage(int32_t millivolts) {
+  return constrain(map(millivolts, SOC_EMPTY_MV, SOC_FULL_MV, 0, 100), 0, 100);
 }
 
-void updateStatusLEDs(unsigned long currentTime) {
-  bool anyUnhealthy = false;
-  for (int i = 0; i < NUM_BATTERIES; i++) {
-    if (!batteries[i].isHealthy) {
-      anyUnhealthy = true;
-      break;
-    }
+void readBatteries() {
+  if (++scansSinceAvccMeasure >= AVCC_MEASURE_SCANS) {
+    measureAvcc();
+    scansSinceAvccMeasure = 0;
   }
 
-  if (anyUnhealthy) {
-    // Blink red LED for warnings
-    if (currentTime - lastLedUpdate >= 500) {
-      ledState = !ledState;
-      digitalWrite(RED_LED, ledState ? HIGH : LOW);
-      digitalWrite(GREEN_LED, LOW);
-      lastLedUpdate = currentTime;
-    }
-  } else {
-    // Solid green for all healthy
-    digitalWrite(RED_LED, LOW);
-    digitalWrite(GREEN_LED, HIGH);
+  // Capture every channel first and convert afterwards, so the channels are
+  // sampled as close together as the ADC allows
+  uint8_t count = config.numBatteries;
+  int raw[MAX_BATTERIES];
+  unsigned long startTick = millis();
+  uint32_t startUs = micros();
+  for (uint8_t i = 0; i < count; i++) {
+    raw[i] = analogRead(batteries[i].analogPin);
   }
-}
+  uint32_t elapsedUs = micros() - startUs;
 
-void logBatteryData(unsigned long timestamp) {
-  // Check if SD card is still available
-  if (!SD.begin(SD_CS_PIN)) {
-    Serial.println("SD card no longer accessible");
-    return;
-  }
+  // One pull test per scan, outside the timed capture
+  if (pullTestChannel >= count) pullTestChannel = 0;
+  channelFaults[pullTestChannel].pullOpen = pullTestOpen(pullTestChannel, raw[pullTestChannel]);
+  pullTestChannel++;
 
-  File logFile = SD.open("battery.csv", FILE_WRITE);
-  if (logFile) {
-    size_t bytesWritten = 0;
+  // Every conversion takes the same time, so the last one started
+  // (count - 1) / count of the way through
+  scanTiming.startTick = startTick;
+  scanTiming.startUs = startUs;
+  scanTiming.skewUs = elapsedUs * (count - 1) / count;
+  if (scanTiming.skewUs > scanTiming.maxSkewUs) scanTiming.maxSkewUs = scanTiming.skewUs;
 
-    // Write timestamp
-    bytesWritten += logFile.print(getDateTimeForCSV());
-    bytesWritten += logFile.print(",");
+  resetBanks(banks);
+  for (uint8_t i = 0; i < count; i++) {
+    batteries[i].rawValue = raw[i];
+    batteries[i].millivolts = rawToMillivolts(i, raw[i]);
+    batteries[i].voltage = batteries[i].millivolts * 0.001;
+    batteries[i].percentage = millivoltsToPercentage(batteries[i].millivolts);
+    batteries[i].overRange = raw[i] >= 1023 - FAULT_RAIL_MARGIN;
+    batteries[i].lastUpdate = startTick;
 
-    // Write battery data
-    for (int i = 0; i < NUM_BATTERIES; i++) {
-      bytesWritten += logFile.print(batteries[i].rawValue);
-      bytesWritten += logFile.print(",");
-      bytesWritten += logFile.print(batteries[i].voltage, 3);
-      bytesWritten += logFile.print(",");
-      bytesWritten += logFile.print(batteries[i].percentage, 1);
-      if (i < NUM_BATTERIES - 1) bytesWritten += logFile.print(",");
+    // A faulted channel's reading is reported as it is, but not judged
+    updateChannelFault(i, raw[i]);
+    if (channelFaults[i].fault != FAULT_NONE) {
+      batteries[i].isHealthy = false;
+      if (config.cellBank[i] != 0) banks[config.cellBank[i] - 1].faults++;
+      continue;
     }
-    bytesWritten += logFile.println();
-
-    logFile.flush(); // Force write to SD card
-    logFile.close();
 
-    if (bytesWritten > 0) {
-      Serial.print("Data logged (");
-      Serial.print(bytesWritten);
-      Serial.println(" bytes)");
-    } else {
-      Serial.println("Warning: No data written to SD card");
-    }
-  } else {
-    Serial.println("ERROR: Cannot open battery.csv for writing");
-    Serial.println("Possible causes:");
-    Serial.println("- SD card removed or corrupted");
-    Serial.println("- SD card full");
-    Serial.println("- File system error");
+    addBankCell(banks, i, batteries[i].millivolts);
+    // Consider below 20% (approximately 10.5V for 12V battery) as unhealthy
+    batteries[i].isHealthy = batteries[i].percentage > 20;
+    updateDropDetector(i, batteries[i].millivolts, startTick);
   }
+  checkBankAlarms();
 }
 
-void handleWebRequests() {
-  EthernetClient client = server.available();
-  if (client) {
-    String request = "";
-    while (client.connected()) {
-      if (client.available()) {
-        char c = client.read();
-        request += c;
-
-        if (c == '\n' && request.endsWith("\r\n\r\n")) {
-          break;
-        }
-      }
-    }
+void updateDropDetector(uint8_t channel, int32_t millivolts, unsigned long now) {
+  DropDetector& detector = dropDetectors[channel];
+  if (detector.warning && now - detector.lastEvent >= DROP_WARNING_HOLD_MS) detector.warning = false;
 
-    // Parse request
-    if (request.indexOf("GET / ") >= 0) {
-      sendDashboard(client);
-    } else if (request.indexOf("GET /api/current") >= 0) {
-      sendCurrentData(client);
-    } else if (request.indexOf("GET /api/history") >= 0) {
-      sendHistoryData(client);
-    } else {
-      send404(client);
-    }
+  if (detector.scans == 0) detector.baselineQ4 = millivolts << 4;
+  if (detector.scans < DROP_WARMUP_SCANS) {
+    detector.scans++;
+    detector.baselineQ4 += ((millivolts << 4) - detector.baselineQ4) >> DROP_BASELINE_SHIFT;
+    return;
+  }
+  if (config.cusumThresholdMv == 0) return;
 
-    client.stop();
+  int32_t sum = (int32_t)detector.sum + (detector.baselineQ4 >> 4) - millivolts - config.cusumDriftMv;
+  if (sum <= 0) {
+    // Nothing building up: let the baseline follow the reading
+    detector.sum = 0;
+    detector.baselineQ4 += ((millivolts << 4) - detector.baselineQ4) >> DROP_BASELINE_SHIFT;
+    return;
+  }
+  if (sum <= config.cusumThresholdMv) {
+    detector.sum = sum;
+    return;
   }
+
+  // Step detected: warn, and re-arm at the new level
+  Serial.print(F("WARNING: Battery "));
+  Serial.print(channel + 1);
+  Serial.print(F(" dropped from "));
+  Serial.print(detector.baselineQ4 >> 4);
+  Serial.print(F(" to "));
+  Serial.print(millivolts);
+  Serial.println(F(" mV"));
+  dropEvents++;
+  detector.warning = true;
+  detector.lastEvent = now;
+  detector.sum = 0;
+  detector.baselineQ4 = millivolts << 4;
+  currentDisplayBattery = channel;
+  lastDisplayUpdate = now - config.displayUpdate; // Show it on the next pass
 }
 
-void sendDashboard(EthernetClient& client) {
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-Type: text/html");
-  client.println("Connection: close");
-  client.println();
+// Readings jump when the calibration or battery set changes; learn new baselines
+void resetDropDetectors() {
+  for (uint8_t i = 0; i < MAX_BATTERIES; i++) {
+    dropDetectors[i].scans = 0;
+    dropDetectors[i].sum = 0;
+  }
+}
 
-  client.println("<!DOCTYPE html>");
-  client.println("<html>");
-  client.println("<head>");
-  client.println("<title>Battery Monitor Dashboard</title>");
-  client.println("<meta name='viewport' content='width=device-width, initial-scale=1'>");
-  client.println("<style>");
-  client.println("body { font-family: Arial, sans-serif; margin: 20px; background: #f0f0f0; }");
-  client.println(".container { max-width: 1200px; margin: 0 auto; background: white; padding: 20px; border-radius: 10px; }");
-  client.println(".battery-grid { display: grid; grid-template-columns: repeat(auto-fit, minmax(200px, 1fr)); gap: 15px; margin: 20px 0; }");
-  client.println(".battery-card { border: 2px solid #ddd; border-radius: 8px; padding: 15px; text-align: center; }");
-  client.println(".healthy { border-color: #4CAF50; background: #f8fff8; }");
-  client.println(".warning { border-color: #ff9800; background: #fff8f0; }");
-  client.println(".critical { border-color: #f44336; background: #fff0f0; }");
-  client.println(".voltage { font-size: 24px; font-weight: bold; margin: 10px 0; }");
-  client.println(".percentage { font-size: 18px; color: #666; }");
-  client.println("h1 { text-align: center; color: #333; }");
-  client.println("</style>");
-  client.println("</head>");
-  client.println("<body>");
-  client.println("<div class='container'>");
-  client.println("<h1>Battery Monitor Dashboard</h1>");
-  client.print("<p style='text-align: center; color: #666;'>Device: ");
-  client.print(mdnsHostname);
-  client.print(".local | IP: ");
-  client.print(assignedIP);
-  client.println("</p>");
-  client.println("<p id='datetime' style='text-align: center; color: #888; font-size: 14px;'></p>");
-  client.println("<div class='battery-grid' id='batteryGrid'>");
-  client.println("</div>");
-  client.println("</div>");
-
-  client.println("<script>");
-  client.println("function updateDashboard() {");
-  client.println("  fetch('/api/current')");
-  client.println("    .then(response => response.json())");
-  client.println("    .then(data => {");
-  client.println("      const grid = document.getElementById('batteryGrid');");
-  client.println("      grid.innerHTML = '';");
-  client.println("      data.batteries.forEach((battery, index) => {");
-  client.println("        const card = document.createElement('div');");
-  client.println("        card.className = 'battery-card ' + (battery.percentage > 50 ? 'healthy' : battery.percentage > 20 ? 'warning' : 'critical');");
-  client.println("        card.innerHTML = `");
-  client.println("          <h3>Battery ${index + 1}</h3>");
-  client.println("          <div class='voltage'>${battery.voltage.toFixed(2)}V</div>");
-  client.println("          <div class='percentage'>${battery.percentage.toFixed(1)}%</div>");
-  client.println("          <div>Raw: ${battery.raw}</div>");
-  client.println("        `;");
-  client.println("        grid.appendChild(card);");
-  client.println("      });");
-  client.println("      // Update datetime display");
-  client.println("      if (data.datetime) {");
-  client.println("        document.getElementById('datetime').textContent = 'Last updated: ' + data.datetime;");
-  client.println("      }");
-  client.println("    });");
-  client.println("}");
-  client.println("updateDashboard();");
-  client.println("setInterval(updateDashboard, 2000);");
-  client.println("</script>");
-  client.println("</body>");
-  client.println("</html>");
+void resetChannelFault(uint8_t channel) {
+  ChannelFault& state = channelFaults[channel];
+  state.noiseQ4 = 0;
+  state.lastRaw = -1;
+  state.fault = FAULT_NONE;
+  state.candidate = FAULT_NONE;
+  state.count = 0;
+  state.pullOpen = false;
 }
 
-void sendCurrentData(EthernetClient& client) {
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-Type: application/json");
-  client.println("Connection: close");
+// Converts the channel again with its pull-up on. A pin that the pull-up
+// takes from `raw` to the rail has a source impedance far above the
+// pull-up's, i.e. nothing connected.
+bool pullTestOpen(uint8_t channel, int raw) {
+  uint8_t pin = batteries[channel].analogPin;
+  pinMode(pin, INPUT_PULLUP);
+  int pulled = analogRead(pin);
+  pinMode(pin, INPUT);
+
+  bool open = pulled >= 1023 - FAULT_RAIL_MARGIN && pulled - raw >= FAULT_PULL_RISE;
+  if (open) {
+    // Otherwise the pin keeps the pull-up's charge and reads high until it
+    // leaks away. Driving it low is safe: the test showed it is not driven.
+    digitalWrite(pin, LOW);
+    pinMode(pin, OUTPUT);
+    pinMode(pin, INPUT);
+  }
+  return open;
+}
+
+// Classifies the latest scan of a channel and debounces the result
+void updateChannelFault(uint8_t channel, int raw) {
+  ChannelFault& state = channelFaults[channel];
+  if (state.lastRaw >= 0) {
+    uint16_t change = abs(raw - state.lastRaw);
+    state.noiseQ4 += ((int16_t)(change << 4) - (int16_t)state.noiseQ4) >> FAULT_NOISE_SHIFT;
+  }
+  state.lastRaw = raw;
+
+  uint8_t seen = FAULT_NONE;
+  if (state.pullOpen) seen = FAULT_OPEN_WIRE;
+  else if (raw <= FAULT_RAIL_MARGIN) seen = FAULT_RAIL_LOW;
+  else if (state.noiseQ4 > FAULT_NOISE_LIMIT << 4) seen = FAULT_NOISY;
+
+  if (seen == state.fault) {
+    state.count = 0;
+    return;
+  }
+  if (seen != state.candidate) {
+    state.candidate = seen;
+    state.count = 0;
+  }
+  if (++state.count < (seen == FAULT_NONE ? FAULT_CLEAR_SCANS : FAULT_CONFIRM_SCANS)) return;
+
+  state.fault = seen;
+  state.count = 0;
+  Serial.print(seen == FAULT_NONE ? F("Battery ") : F("FAULT: Battery "));
+  Serial.print(channel + 1);
+  Serial.print(F(" channel "));
+  Serial.println(seen == FAULT_NONE ? F("recovered") : (const __FlashStringHelper*)FAULT_NAMES[seen]);
+  if (seen != FAULT_NONE) faultEvents++;
+
+  // The readings before and after are not comparable
+  dropDetectors[channel].scans = 0;
+  dropDetectors[channel].sum = 0;
+  dropDetectors[channel].warning = false;
+}
+
+bool anyChannelFault() {
+  for (uint8_t i = 0; i < config.numBatteries; i++) {
+    if (channelFaults[i].fault != FAULT_NONE) return true;
+  }
+  return false;
+}
+
+// Number of banks in use: the highest bank any active battery belongs to
+uint8_t bankCount() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < config.numBatteries; i++) {
+    if (config.cellBank[i] > count) count = config.cellBank[i];
+  }
+  return count;
+}
+
+void resetBanks(BankState* states) {
+  for (uint8_t b = 0; b < MAX_BANKS; b++) {
+    states[b].totalMv = 0;
+    states[b].minMv = INT32_MAX;
+    states[b].maxMv = 0;
+    states[b].cells = 0;
+    states[b].faults = 0;
+    states[b].worst = 0;
+  }
+}
+
+// Folds one cell into its bank's running total, spread and weakest cell
+void addBankCell(BankState* states, uint8_t channel, int32_t millivolts) {
+  uint8_t bank = config.cellBank[channel];
+  if (bank == 0) return;
+
+  BankState& state = states[bank - 1];
+  state.totalMv += millivolts;
+  state.cells++;
+  if (millivolts < state.minMv) {
+    state.minMv = millivolts;
+    state.worst = channel;
+  }
+  if (millivolts > state.maxMv) state.maxMv = millivolts;
+}
+
+void checkBankAlarms() {
+  if (config.bankSpreadAlarmMv == 0) return;
+
+  for (uint8_t b = 0; b < MAX_BANKS; b++) {
+    BankState& state = banks[b];
+    if (state.cells < 2) {
+      state.alarm = false;
+      continue;
+    }
+
+    int32_t spread = state.maxMv - state.minMv;
+    if (!state.alarm && spread > config.bankSpreadAlarmMv) {
+      state.alarm = true;
+      bankAlarms++;
+      Serial.print(F("ALARM: Bank "));
+      Serial.print(b + 1);
+      Serial.print(F(" imbalance "));
+      Serial.print(spread);
+      Serial.print(F(" mV, weakest battery "));
+      Serial.println(state.worst + 1);
+    } else if (state.alarm && spread + BANK_ALARM_HYSTERESIS_MV < config.bankSpreadAlarmMv) {
+      state.alarm = false;
+    }
+  }
+}
+
+// Daily statistics
+//
+// A P² estimator tracks quantiles with markers: the minimum, the maximum,
+// one at each quantile and one halfway between each neighbouring pair, so
+// P5, P50 and P95 share nine markers. Every observation moves the ranks of
+// the markers above it; a marker that has drifted a whole rank from where
+// its target says it should be is moved one rank, and its height
+// re-estimated from a parabola through it and its neighbours. The state is
+// fixed and each update is constant time, with no stored samples.
+
+void updateDailyStats(unsigned long now) {
+  if (now - lastStatsSample < STATS_SAMPLE_INTERVAL) return;
+  lastStatsSample = now;
+  if (dailySummaryPending) return; // The finished day's estimators are still to be written out
+
+  if (clockIsSet()) {
+    uint16_t day = (getUTCTimestamp() + config.timezoneOffset) / 86400UL;
+    if (statsDay != 0 && day != statsDay) {
+      closeStatsDay();
+      statsDay = day;
+      return;
+    }
+    statsDay = day; // Before the first sync, samples count towards the day it reveals
+  }
+
+  if (statsSamples == UINT16_MAX) return;
+  for (uint8_t i = 0; i < config.numBatteries; i++) {
+    ChannelQuantiles& q = quantiles[i];
+    if (channelFaults[i].fault != FAULT_NONE) continue;
+    addQuantileObservation(q, q.samples, batteries[i].millivolts);
+    q.samples++;
+  }
+  statsSamples++;
+}
+
+// Adds the observation after the first `count` to a channel's estimator
+void addQuantileObservation(ChannelQuantiles& q, uint16_t count, uint16_t millivolts) {
+  const uint8_t held = QUANTILE_MARKERS + 2;
+  if (count < held) {
+    // Collect the first nine, then start the estimator from them, sorted
+    if (count == 0) q.minMv = millivolts;
+    else if (count == 1) q.maxMv = millivolts;
+    else q.height[count - 2] = millivolts;
+    if (count < held - 1) return;
+
+    uint16_t sorted[held];
+    for (uint8_t i = 0; i < held; i++) {
+      uint16_t value = i == 0 ? q.minMv : i == 1 ? q.maxMv : q.height[i - 2];
+      uint8_t j = i;
+      for (; j > 0 && sorted[j - 1] > value; j--) sorted[j] = sorted[j - 1];
+      sorted[j] = value;
+    }
+    q.minMv = sorted[0];
+    q.maxMv = sorted[held - 1];
+    for (uint8_t i = 0; i < QUANTILE_MARKERS; i++) {
+      q.height[i] = sorted[i + 1];
+      q.position[i] = i + 2;
+    }
+    return;
+  }
+
+  if (millivolts < q.minMv) q.minMv = millivolts;
+  if (millivolts > q.maxMv) q.maxMv = millivolts;
+  for (uint8_t i = 0; i < QUANTILE_MARKERS; i++) {
+    if (millivolts < q.height[i]) q.position[i]++;
+  }
+  adjustQuantileMarkers(q, count + 1);
+}
+
+void adjustQuantileMarkers(ChannelQuantiles& q, uint16_t count) {
+  for (uint8_t i = 0; i < QUANTILE_MARKERS; i++) {
+    // Neighbours, the end markers sitting at ranks 1 and count
+    float n = q.position[i];
+    float h = q.height[i];
+    float belowN = i == 0 ? 1 : q.position[i - 1];
+    float belowH = i == 0 ? q.minMv : q.height[i - 1];
+    float aboveN = i == QUANTILE_MARKERS - 1 ? count : q.position[i + 1];
+    float aboveH = i == QUANTILE_MARKERS - 1 ? q.maxMv : q.height[i + 1];
+
+    float drift = 1 + (count - 1) * pgm_read_float(&QUANTILE_TARGETS[i]) - n;
+    int8_t s;
+    if (drift >= 1 && aboveN - n > 1) s = 1;
+    else if (drift <= -1 && belowN - n < -1) s = -1;
+    else continue;
+
+    float parabolic = h + s / (aboveN - belowN) *
+        ((n - belowN + s) * (aboveH - h) / (aboveN - n) + (aboveN - n - s) * (h - belowH) / (n - belowN));
+    if (belowH < parabolic && parabolic < aboveH) {
+      h = parabolic;
+    } else if (s > 0) {
+      h += (aboveH - h) / (aboveN - n);
+    } else {
+      h -= (belowH - h) / (belowN - n);
+    }
+    q.height[i] = h + 0.5;
+    q.position[i] += s;
+  }
+}
+
+// One of DAILY_STAT_NAMES for a channel after `count` observations. Below
+// nine the estimator has not started, so it is read off the samples held.
+uint16_t dailyStatMillivolts(const ChannelQuantiles& q, uint16_t count, uint8_t which) {
+  const uint8_t held = QUANTILE_MARKERS + 2;
+  if (count >= held) {
+    if (which == QUANTILE_COUNT) return q.minMv;
+    if (which == QUANTILE_COUNT + 1) return q.maxMv;
+    return q.height[2 * which + 1];
+  }
+  if (count == 0) return 0;
+
+  uint16_t sorted[held];
+  for (uint8_t i = 0; i < count; i++) {
+    uint16_t value = i == 0 ? q.minMv : i == 1 ? q.maxMv : q.height[i - 2];
+    uint8_t j = i;
+    for (; j > 0 && sorted[j - 1] > value; j--) sorted[j] = sorted[j - 1];
+    sorted[j] = value;
+  }
+  if (which == QUANTILE_COUNT) return sorted[0];
+  if (which == QUANTILE_COUNT + 1) return sorted[count - 1];
+  return sorted[(uint8_t)(pgm_read_float(&QUANTILE_TARGETS[2 * which + 1]) * (count - 1) + 0.5)];
+}
+
+// Marks the day that has ended. Its estimators are left as they are until
+// writeDailySummary has appended them, later in the same loop pass.
+void closeStatsDay() {
+  yesterdayDay = statsDay;
+  yesterdaySamples = statsSamples;
+  dailySummaryPending = true;
+}
+
+// Appends the finished day to DAILY_SUMMARY_FILE, one line per battery, and
+// starts the next. Not retried if the card is unavailable, in which case
+// /api/stats has no figures for yesterday either.
+void writeDailySummary() {
+  dailySummaryPending = false;
+  if (yesterdaySamples > 0) {
+    File summary = SD.open(DAILY_SUMMARY_FILE, FILE_WRITE);
+    if (summary) {
+      uint32_t startSize = summary.size();
+      if (startSize == 0) summary.println(F("Date,Battery,Samples,P5_V,P50_V,P95_V,Min_V,Max_V"));
+
+      char date[11];
+      formatDay(yesterdayDay, date);
+      for (uint8_t i = 0; i < config.numBatteries; i++) {
+        const ChannelQuantiles& q = quantiles[i];
+        summary.print(date);
+        summary.print(',');
+        summary.print(i + 1);
+        summary.print(',');
+        summary.print(q.samples);
+        for (uint8_t j = 0; j < DAILY_STAT_COUNT; j++) {
+          summary.print(',');
+          if (q.samples > 0) summary.print(dailyStatMillivolts(q, q.samples, j) * 0.001, 3);
+        }
+        summary.println();
+      }
+      accountFileGrowth(startSize, summary.size());
+      summary.close();
+    } else {
+      Serial.println(F("ERROR: Cannot write daily summary"));
+    }
+  }
+
+  statsSamples = 0;
+  for (uint8_t i = 0; i < MAX_BATTERIES; i++) quantiles[i].samples = 0;
+}
+
+// Local day number as YYYY-MM-DD
+void formatDay(uint16_t day, char* text) {
+  tmElements_t tm;
+  breakTime((time_t)day * 86400UL, tm);
+  sprintf_P(text, PSTR("%04d-%02d-%02d"), tmYearToCalendar(tm.Year), tm.Month, tm.Day);
+}
+
+void updateDisplay() {
+  lcd.clear();
+  lcd.setCursor(0, 0);
+  lcd.print(F("Bat"));
+  lcd.print(currentDisplayBattery + 1);
+  lcd.print(F(": "));
+
+  uint8_t fault = channelFaults[currentDisplayBattery].fault;
+  if (fault != FAULT_NONE) {
+    lcd.print(F("FAULT"));
+    lcd.setCursor(0, 1);
+    lcd.print((const __FlashStringHelper*)FAULT_LABELS[fault]);
+  } else {
+    lcd.print(batteries[currentDisplayBattery].voltage, 2);
+    lcd.print('V');
+
+    lcd.setCursor(0, 1);
+    lcd.print(batteries[currentDisplayBattery].percentage);
+    lcd.print(F("% "));
+    if (!batteries[currentDisplayBattery].isHealthy) lcd.print(F("LOW"));
+    else if (batteries[currentDisplayBattery].overRange) lcd.print(F("OVER"));
+    else if (dropDetectors[currentDisplayBattery].warning) lcd.print(F("DROP"));
+    else lcd.print(F("OK"));
+  }
+
+  // Cycle through batteries
+  currentDisplayBattery = (currentDisplayBattery + 1) % config.numBatteries;
+}
+
+void updateStatusLEDs(unsigned long currentTime) {
+  bool anyUnhealthy = false;
+  for (int i = 0; i < config.numBatteries; i++) {
+    if (channelFaults[i].fault == FAULT_NONE && !batteries[i].isHealthy) {
+      anyUnhealthy = true;
+      break;
+    }
+  }
+  for (uint8_t b = 0; b < MAX_BANKS; b++) {
+    if (banks[b].alarm) anyUnhealthy = true;
+  }
+  for (int i = 0; i < config.numBatteries; i++) {
+    if (dropDetectors[i].warning) anyUnhealthy = true;
+  }
+
+  if (anyUnhealthy) {
+    // Blink red LED for warnings
+    if (currentTime - lastLedUpdate >= 500) {
+      ledState = !ledState;
+      digitalWrite(RED_LED, ledState ? HIGH : LOW);
+      digitalWrite(GREEN_LED, LOW);
+      lastLedUpdate = currentTime;
+    }
+  } else if (anyChannelFault()) {
+    // Solid red: the batteries that can be read are fine, but a channel is not
+    digitalWrite(RED_LED, HIGH);
+    digitalWrite(GREEN_LED, LOW);
+  } else {
+    // Solid green for all healthy
+    digitalWrite(RED_LED, LOW);
+    digitalWrite(GREEN_LED, HIGH);
+  }
+}
+
+void logBatteryData() {
+  // Samples go through the preserved ring first, so nothing is lost if the
+  // card is unavailable or the unit resets before the write completes
+  queueSample(epochMillis());
+
+  // Check if SD card is still available
+  if (!SD.begin(SD_CS_PIN)) {
+    Serial.println(F("SD card no longer accessible"));
+    return;
+  }
+
+  TRACE_BEGIN(TRACE_FLUSH_SAMPLES, persistent.ring.count);
+  flushSamples();
+  TRACE_END(TRACE_FLUSH_SAMPLES, persistent.ring.count);
+
+  // Make room before the card fills up
+  pruneLogSegments();
+}
+
+void queueSample(uint64_t epochMs) {
+  SampleRing& ring = persistent.ring;
+  if (ring.count == SAMPLE_RING_SIZE) {
+    // Card has been unavailable for a while: drop the oldest sample
+    ring.head = (ring.head + 1) % SAMPLE_RING_SIZE;
+    ring.count--;
+    counters.logRecordsDropped++;
+    sealBlock(counters);
+  }
+
+  // Fill and seal the record before publishing it in the ring header
+  SampleRecord& record = persistent.samples[(ring.head + ring.count) % SAMPLE_RING_SIZE];
+  record.epochMs = epochMs;
+  record.boot = bootId;
+  record.tick = scanTiming.startTick;
+  record.avccMv = avccMillivolts;
+  record.cal = calibration.generation;
+  record.numBatteries = config.numBatteries;
+  memset(record.rawLow, 0, sizeof(record.rawLow));
+  for (uint8_t i = 0; i < MAX_BATTERIES; i++) {
+    uint16_t raw = i < config.numBatteries ? batteries[i].rawValue : 0;
+    record.rawHigh[i] = raw >> 2;
+    record.rawLow[i / 4] |= (raw & 3) << ((i % 4) * 2);
+  }
+  sealBlock(record);
+
+  ring.count++;
+  sealBlock(ring);
+}
+
+// Appends every pending sample to the log. The ring header is only advanced
+// once the file is closed, so a reset mid-write repeats records rather than
+// losing them (and the torn tail is trimmed at boot).
+void flushSamples() {
+  SampleRing& ring = persistent.ring;
+  if (ring.count == 0) return;
+
+  // New segment when the current one is full or its columns are out of date.
+  // Runs do not cross segments.
+  if ((activeLogSize >= LOG_SEGMENT_MAX_BYTES || activeHeaderCrc != logHeaderCrc()) && activeLogSegment < LOG_SEGMENT_LIMIT) {
+    closeLogRun();
+    startLogSegment(activeLogSegment + 1);
+  }
+
+  File logFile = SD.open(logFileName, FILE_WRITE);
+  if (logFile) {
+    uint32_t startSize = logFile.size();
+    if (logWriteFailed) {
+      // Close off the fragment of the failed write with a void trailer so
+      // that readers discard it instead of merging it into the next block
+      logFile.println();
+      logFile.print('#');
+      logFile.print(logBlockSeq++);
+      logFile.println(F(",x"));
+    }
+
+    CrcPrint block(logFile);
+    size_t bytesWritten = 0;
+    uint8_t head = ring.head;
+    uint8_t written = 0;
+    LogRun savedRun = logRun;
+
+    for (uint8_t n = 0; n < ring.count; n++) {
+      const SampleRecord& record = persistent.samples[head];
+      head = (head + 1) % SAMPLE_RING_SIZE;
+      if (!isBlockSealed(record)) {
+        counters.logRecordsDropped++;
+        continue;
+      }
+
+      // Samples taken before the first sync of this boot can be back-dated now
+      uint64_t epochMs = record.epochMs;
+      if (epochMs == 0 && record.boot == bootId && bootClock.epochMs != 0) {
+        epochMs = epochFromTick(bootClock, record.tick);
+      }
+
+      // Same data as the last record, at the usual interval: extend the run
+      NullPrint sink;
+      CrcPrint data(sink);
+      writeLogRecordData(data, record);
+      uint32_t gap = record.tick - (logRun.repeats > 0 ? logRun.lastTick : logRun.startTick);
+      if (logRun.open && record.boot == logRun.boot && data.crc == logRun.dataCrc &&
+          gap + config.logInterval / 4 >= config.logInterval && gap <= config.logInterval + config.logInterval / 4) {
+        logRun.repeats++;
+        logRun.lastTick = record.tick;
+        written++;
+        if (logRun.repeats >= LOG_RUN_MAX) bytesWritten += writeLogRun(block);
+        continue;
+      }
+      if (logRun.repeats > 0) bytesWritten += writeLogRun(block);
+
+      // Write timestamp, boot and tick
+      if (config.logMode & LOG_MODE_EPOCH) bytesWritten += printUint64(block, epochMs);
+      else bytesWritten += block.print(getDateTimeForCSV(epochMs));
+      bytesWritten += block.print(',');
+      bytesWritten += block.print(record.boot);
+      bytesWritten += block.print(',');
+      bytesWritten += block.print(record.tick);
+      bytesWritten += block.print(',');
+
+      // Write battery data
+      bytesWritten += writeLogRecordData(block, record);
+      bytesWritten += block.println();
+      written++;
+
+      logRun.open = true;
+      logRun.boot = record.boot;
+      logRun.dataCrc = data.crc;
+      logRun.startTick = record.tick;
+      logRun.repeats = 0;
+    }
+
+    // Close the block so readers can verify it (nothing to close if every
+    // sample only extended the run)
+    if (bytesWritten > 0) writeLogTrailer(logFile, block.crc);
+
+    logFile.flush(); // Force write to SD card
+    logWriteFailed = logFile.getWriteError();
+    activeLogSize = logFile.size();
+    accountFileGrowth(startSize, activeLogSize);
+    logFile.close();
+
+    if (logWriteFailed) {
+      // Most likely a full card; keep the samples for the next attempt
+      Serial.println(F("ERROR: Write to log failed, samples kept for retry"));
+      logRun = savedRun;
+      return;
+    }
+
+    ring.head = head;
+    ring.count = 0;
+    sealBlock(ring);
+    sealBlock(logRun); // A reset before this drops the run along with its repeats
+    counters.logRecords += written;
+    sealBlock(counters);
+
+    if (bytesWritten > 0) {
+      Serial.print(F("Data logged ("));
+      Serial.print(bytesWritten);
+      Serial.println(F(" bytes)"));
+    } else if (logRun.repeats == 0) {
+      Serial.println(F("Warning: No data written to SD card"));
+    }
+  } else {
+    Serial.print(F("ERROR: Cannot open "));
+    Serial.print(logFileName);
+    Serial.println(F(" for writing"));
+    Serial.println(F("Possible causes:"));
+    Serial.println(F("- SD card removed or corrupted"));
+    Serial.println(F("- SD card full"));
+    Serial.println(F("- File system error"));
+  }
+}
+
+uint16_t recordRaw(const SampleRecord& record, uint8_t channel) {
+  return (record.rawHigh[channel] << 2) | ((record.rawLow[channel / 4] >> ((channel % 4) * 2)) & 3);
+}
+
+// The data columns of a record, as written after its tick
+size_t writeLogRecordData(Print& out, const SampleRecord& record) {
+  size_t bytes = 0;
+  if (config.logMode & LOG_MODE_RAW) {
+    bytes += out.print(record.cal);
+    bytes += out.print(',');
+    bytes += out.print(record.avccMv);
+    for (uint8_t i = 0; i < record.numBatteries; i++) {
+      bytes += out.print(',');
+      bytes += out.print(recordRaw(record, i));
+    }
+    return bytes;
+  }
+
+  BankState recordBanks[MAX_BANKS];
+  resetBanks(recordBanks);
+  for (uint8_t i = 0; i < record.numBatteries; i++) {
+    uint16_t raw = recordRaw(record, i);
+    int32_t millivolts = rawToMillivoltsAt(i, raw, record.avccMv);
+    addBankCell(recordBanks, i, millivolts);
+    bytes += out.print(raw);
+    bytes += out.print(',');
+    bytes += out.print(millivolts * 0.001, 3);
+    bytes += out.print(',');
+    bytes += out.print(millivoltsToPercentage(millivolts), 1);
+    if (i < record.numBatteries - 1) bytes += out.print(',');
+  }
+
+  // Bank totals, spreads and weakest cells (left empty for a bank with no cells)
+  for (uint8_t b = 0; b < bankCount(); b++) {
+    const BankState& bank = recordBanks[b];
+    bytes += out.print(',');
+    if (bank.cells == 0) {
+      bytes += out.print(F(",,"));
+      continue;
+    }
+    bytes += out.print(bank.totalMv * 0.001, 3);
+    bytes += out.print(',');
+    bytes += out.print(bank.maxMv - bank.minMv);
+    bytes += out.print(',');
+    bytes += out.print(bank.worst + 1);
+  }
+  return bytes;
+}
+
+// Writes the pending repeats as an R line. The interval is their average, and
+// the run carries on from where a reader will place the last of them.
+size_t writeLogRun(Print& out) {
+  uint32_t interval = (logRun.lastTick - logRun.startTick + logRun.repeats / 2) / logRun.repeats;
+  size_t bytes = out.print(F("R,"));
+  bytes += out.print(logRun.repeats);
+  bytes += out.print(',');
+  bytes += out.println(interval);
+
+  logRunSamples += logRun.repeats;
+  logRun.startTick += interval * logRun.repeats;
+  logRun.repeats = 0;
+  return bytes;
+}
+
+// Writes any pending repeats to the active segment as a block of their own
+// and ends the run
+void closeLogRun() {
+  if (logRun.repeats > 0) {
+    File logFile = SD.open(logFileName, FILE_WRITE);
+    if (logFile) {
+      uint32_t startSize = logFile.size();
+      CrcPrint block(logFile);
+      writeLogRun(block);
+      writeLogTrailer(logFile, block.crc);
+      activeLogSize = logFile.size();
+      accountFileGrowth(startSize, activeLogSize);
+      logFile.close();
+    }
+  }
+  logRun.open = false;
+  logRun.repeats = 0;
+  sealBlock(logRun);
+}
+
+void handleWebRequests() {
+  acceptHttpConnections();
+  pollHttpRequests();
+  serveRealtimeRequests();
+
+  // Stream bulk responses chunk by chunk until the budget runs out. New
+  // connections are picked up between chunks so that a real-time request
+  // never waits behind more than one chunk of a history download.
+  unsigned long bulkStart = millis();
+  while (millis() - bulkStart < BULK_TICK_BUDGET) {
+    HttpConnection* conn = nextBulkConnection();
+    if (conn == NULL) break;
+
+    bool verify = conn->route == ROUTE_VERIFY;
+    TRACE_BEGIN(TRACE_BULK_CHUNK, conn->route);
+    if (conn->state == HTTP_READY) {
+      if (verify) beginLogVerify(*conn);
+      else beginHistoryData(*conn);
+      conn->state = HTTP_STREAMING;
+    } else if (verify ? continueLogVerify(*conn) : continueHistoryData(*conn)) {
+      closeHttpConnection(*conn);
+    }
+    TRACE_END(TRACE_BULK_CHUNK, conn->route);
+
+    acceptHttpConnections();
+    pollHttpRequests();
+    serveRealtimeRequests();
+  }
+}
+
+void acceptHttpConnections() {
+  while (true) {
+    EthernetClient incoming = server.accept();
+    if (!incoming) return;
+
+    HttpConnection* conn = NULL;
+    for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+      if (httpConnections[i].state == HTTP_FREE) {
+        conn = &httpConnections[i];
+        break;
+      }
+    }
+
+    if (conn == NULL) {
+      // Every slot is busy: refuse quickly rather than leave the socket hanging
+      send503(incoming);
+      incoming.stop();
+      continue;
+    }
+
+    conn->client = MeteredClient(incoming);
+    conn->state = HTTP_READING;
+    conn->route = ROUTE_NOT_FOUND;
+    conn->status = 200;
+    conn->clientIP = incoming.remoteIP();
+    conn->startTime = millis();
+  }
+}
+
+// Reads whatever request bytes have arrived without waiting for more. Only
+// the request line is kept; headers are skipped up to the blank line.
+void pollHttpRequests() {
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    HttpConnection& conn = httpConnections[i];
+    if (conn.state != HTTP_READING) continue;
+
+    if (httpRequestLineOwner == NULL) {
+      httpRequestLineOwner = &conn;
+      httpRequestLineSince = millis();
+      httpRequestLength = 0;
+      httpRequestLineDone = false;
+      httpHeaderTail = 0;
+    }
+    while (httpRequestLineOwner == &conn && conn.client.available()) {
+      char c = conn.client.read();
+      if (!httpRequestLineDone) {
+        if (c == '\r' || c == '\n') {
+          httpRequestLineDone = true;
+        } else if (httpRequestLength < HTTP_REQUEST_LINE_MAX - 1) {
+          httpRequestLine[httpRequestLength++] = c;
+        }
+      }
+      httpHeaderTail = (httpHeaderTail << 8) | (uint8_t)c;
+      if (httpHeaderTail == 0x0D0A0D0AUL) {
+        conn.state = HTTP_READY;
+        break;
+      }
+    }
+
+    if (conn.state == HTTP_READING) {
+      // Only the owner of the request line is timed: a client waiting for the
+      // buffer has not had a chance to send yet
+      bool expired = httpRequestLineOwner == &conn && millis() - httpRequestLineSince > HTTP_REQUEST_TIMEOUT;
+      if (!conn.client.connected() || expired) {
+        conn.status = 408;
+        closeHttpConnection(conn);
+      }
+      continue;
+    }
+
+    // Request complete: classify it and apply the client's rate limit
+    httpRequestLine[httpRequestLength] = '\0';
+    conn.route = classifyRoute(httpRequestLine);
+    if (conn.route == ROUTE_NOT_FOUND) conn.status = 404;
+    if (conn.route == ROUTE_TRACE && !TRACE_ENABLED) conn.status = 404;
+
+    if (!bulkSlotFree(conn)) {
+      conn.status = 503;
+      send503(conn.client);
+      closeHttpConnection(conn);
+      continue;
+    }
+
+    uint16_t retryAfter;
+    if (!admitRequest(conn.clientIP, conn.route, retryAfter)) {
+      conn.status = 429;
+      send429(conn.client, retryAfter);
+      closeHttpConnection(conn);
+    }
+  }
+}
+
+// Answers every complete real-time request. Returns true if any were served.
+bool serveRealtimeRequests() {
+  bool served = false;
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    HttpConnection& conn = httpConnections[i];
+    if (conn.state != HTTP_READY || ROUTE_PRIORITY[conn.route] != PRIORITY_REALTIME) continue;
+
+    switch (conn.route) {
+      case ROUTE_DASHBOARD: sendDashboard(conn.client); break;
+      case ROUTE_CURRENT: sendCurrentData(conn.client); break;
+      case ROUTE_ACCESS: sendAccessLog(conn.client); break;
+      case ROUTE_METRICS: sendMetrics(conn.client); break;
+      case ROUTE_CONFIG: handleConfigRequest(conn); break;
+      case ROUTE_CALIBRATE: handleCalibrationRequest(conn); break;
+      case ROUTE_STATS: sendStats(conn.client); break;
+      case ROUTE_TRACE: sendTrace(conn.client); break;
+      default: send404(conn.client); break;
+    }
+    closeHttpConnection(conn);
+    served = true;
+  }
+  return served;
+}
+
+// Round-robin over bulk connections that can take another chunk. Clients
+// that went away are closed here; slow readers are skipped until their
+// transmit buffer drains.
+HttpConnection* nextBulkConnection() {
+  for (uint8_t n = 0; n < HTTP_MAX_CONNECTIONS; n++) {
+    uint8_t i = (nextBulkSlot + n) % HTTP_MAX_CONNECTIONS;
+    HttpConnection& conn = httpConnections[i];
+    if (conn.state != HTTP_READY && conn.state != HTTP_STREAMING) continue;
+    if (ROUTE_PRIORITY[conn.route] != PRIORITY_BULK) continue;
+
+    if (!conn.client.connected()) {
+      closeHttpConnection(conn);
+      continue;
+    }
+    if (conn.state == HTTP_STREAMING && conn.client.availableForWrite() < HISTORY_CHUNK_MIN_SPACE) continue;
+
+    nextBulkSlot = (i + 1) % HTTP_MAX_CONNECTIONS;
+    return &conn;
+  }
+  return NULL;
+}
+
+// A bulk route may not take the last slot, so that one is always left for
+// real-time routes. Returns false if conn's bulk request must be refused.
+bool bulkSlotFree(const HttpConnection& conn) {
+  if (ROUTE_PRIORITY[conn.route] != PRIORITY_BULK) return true;
+
+  uint8_t bulk = 0;
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    const HttpConnection& other = httpConnections[i];
+    if (&other == &conn) continue;
+    if (other.state != HTTP_READY && other.state != HTTP_STREAMING) continue;
+    if (ROUTE_PRIORITY[other.route] == PRIORITY_BULK) bulk++;
+  }
+  return bulk < HTTP_MAX_CONNECTIONS - 1;
+}
+
+// Called by a handler once it no longer needs the request line
+void releaseRequestLine(HttpConnection& conn) {
+  if (httpRequestLineOwner == &conn) httpRequestLineOwner = NULL;
+}
+
+void closeHttpConnection(HttpConnection& conn) {
+  if (conn.file) conn.file.close();
+  releaseRequestLine(conn);
+  conn.client.stop();
+  recordAccess(conn.client, conn.clientIP, conn.route, conn.status, conn.startTime);
+  conn.state = HTTP_FREE;
+}
+
+uint8_t classifyRoute(const char* requestLine) {
+  if (strncmp_P(requestLine, PSTR("GET / "), 6) == 0) return ROUTE_DASHBOARD;
+  if (strncmp_P(requestLine, PSTR("GET /api/current"), 16) == 0) return ROUTE_CURRENT;
+  if (strncmp_P(requestLine, PSTR("GET /api/history"), 16) == 0) return ROUTE_HISTORY;
+  if (strncmp_P(requestLine, PSTR("GET /api/access"), 15) == 0) return ROUTE_ACCESS;
+  if (strncmp_P(requestLine, PSTR("GET /metrics"), 12) == 0) return ROUTE_METRICS;
+  if (strncmp_P(requestLine, PSTR("GET /api/config"), 15) == 0) return ROUTE_CONFIG;
+  if (strncmp_P(requestLine, PSTR("POST /api/config"), 16) == 0) return ROUTE_CONFIG;
+  if (strncmp_P(requestLine, PSTR("GET /api/calibrate"), 18) == 0) return ROUTE_CALIBRATE;
+  if (strncmp_P(requestLine, PSTR("POST /api/calibrate"), 19) == 0) return ROUTE_CALIBRATE;
+  if (strncmp_P(requestLine, PSTR("GET /api/verify"), 15) == 0) return ROUTE_VERIFY;
+  if (strncmp_P(requestLine, PSTR("GET /api/stats"), 14) == 0) return ROUTE_STATS;
+  if (strncmp_P(requestLine, PSTR("GET /api/trace"), 14) == 0) return ROUTE_TRACE;
+  return ROUTE_NOT_FOUND;
+}
+
+// Token-bucket admission control. Returns false (with the number of seconds
+// until the request would fit) when the client cannot afford the route.
+bool admitRequest(uint32_t clientIP, uint8_t route, uint16_t& retryAfter) {
+  unsigned long now = millis();
+  RateBucket* bucket = NULL;
+  RateBucket* oldest = &rateBuckets[0];
+
+  for (uint8_t i = 0; i < RATE_LIMIT_CLIENTS; i++) {
+    if (rateBuckets[i].clientIP == clientIP) {
+      bucket = &rateBuckets[i];
+      break;
+    }
+    if (rateBuckets[i].clientIP == 0 ||
+        (oldest->clientIP != 0 && now - rateBuckets[i].lastRefill > now - oldest->lastRefill)) {
+      oldest = &rateBuckets[i];
+    }
+  }
+
+  if (bucket == NULL) {
+    // New client: take a free slot or evict the one idle the longest
+    bucket = oldest;
+    bucket->clientIP = clientIP;
+    bucket->milliTokens = RATE_LIMIT_BURST * 1000;
+    bucket->lastRefill = now;
+  } else {
+    uint32_t refill = (now - bucket->lastRefill) * RATE_LIMIT_TOKENS_PER_SEC;
+    bucket->milliTokens = min(bucket->milliTokens + refill, RATE_LIMIT_BURST * 1000);
+    bucket->lastRefill = now;
+  }
+
+  uint32_t cost = ROUTE_COST[route] * 1000UL;
+  if (bucket->milliTokens >= cost) {
+    bucket->milliTokens -= cost;
+    return true;
+  }
+
+  uint32_t deficit = cost - bucket->milliTokens;
+  retryAfter = (deficit + RATE_LIMIT_TOKENS_PER_SEC * 1000 - 1) / (RATE_LIMIT_TOKENS_PER_SEC * 1000);
+  counters.rateLimited++;
+  sealBlock(counters);
+  return false;
+}
+
+void sendDashboard(EthernetClient& client) {
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/html"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  client.println(F("<!DOCTYPE html>"));
+  client.println(F("<html>"));
+  client.println(F("<head>"));
+  client.println(F("<title>Battery Monitor Dashboard</title>"));
+  client.println(F("<meta name='viewport' content='width=device-width, initial-scale=1'>"));
+  client.println(F("<style>"));
+  client.println(F("body { font-family: Arial, sans-serif; margin: 20px; background: #f0f0f0; }"));
+  client.println(F(".container { max-width: 1200px; margin: 0 auto; background: white; padding: 20px; border-radius: 10px; }"));
+  client.println(F(".battery-grid { display: grid; grid-template-columns: repeat(auto-fit, minmax(200px, 1fr)); gap: 15px; margin: 20px 0; }"));
+  client.println(F(".battery-card { border: 2px solid #ddd; border-radius: 8px; padding: 15px; text-align: center; }"));
+  client.println(F(".healthy { border-color: #4CAF50; background: #f8fff8; }"));
+  client.println(F(".warning { border-color: #ff9800; background: #fff8f0; }"));
+  client.println(F(".critical { border-color: #f44336; background: #fff0f0; }"));
+  client.println(F(".fault { border-color: #9e9e9e; background: #f0f0f0; color: #888; }"));
+  client.println(F(".voltage { font-size: 24px; font-weight: bold; margin: 10px 0; }"));
+  client.println(F(".percentage { font-size: 18px; color: #666; }"));
+  client.println(F("h1 { text-align: center; color: #333; }"));
+  client.println(F("</style>"));
+  client.println(F("</head>"));
+  client.println(F("<body>"));
+  client.println(F("<div class='container'>"));
+  client.println(F("<h1>Battery Monitor Dashboard</h1>"));
+  client.print(F("<p style='text-align: center; color: #666;'>Device: "));
+  client.print(mdnsHostname);
+  client.print(F(".local | IP: "));
+  client.print(assignedIP);
+  client.println(F("</p>"));
+  client.println(F("<p id='datetime' style='text-align: center; color: #888; font-size: 14px;'></p>"));
+  client.println(F("<div class='battery-grid' id='batteryGrid'>"));
+  client.println(F("</div>"));
+  client.println(F("</div>"));
+
+  client.println(F("<script>"));
+  client.println(F("function updateDashboard() {"));
+  client.println(F("  fetch('/api/current')"));
+  client.println(F("    .then(response => response.json())"));
+  client.println(F("    .then(data => {"));
+  client.println(F("      const grid = document.getElementById('batteryGrid');"));
+  client.println(F("      grid.innerHTML = '';"));
+  client.println(F("      data.batteries.forEach((battery, index) => {"));
+  client.println(F("        const card = document.createElement('div');"));
+  client.println(F("        card.className = 'battery-card ' + (battery.fault ? 'fault' : battery.percentage > 50 ? 'healthy' : battery.percentage > 20 ? 'warning' : 'critical');"));
+  client.println(F("        card.innerHTML = `"));
+  client.println(F("          <h3>Battery ${index + 1}</h3>"));
+  client.println(F("          <div class='voltage'>${battery.voltage.toFixed(2)}V</div>"));
+  client.println(F("          <div class='percentage'>${battery.percentage.toFixed(1)}%</div>"));
+  client.println(F("          <div>Raw: ${battery.raw}${battery.fault ? ' - FAULT: ' + battery.fault : battery.over_range ? ' - OVER RANGE' : ''}</div>"));
+  client.println(F("        `;"));
+  client.println(F("        grid.appendChild(card);"));
+  client.println(F("      });"));
+  client.println(F("      // Update datetime display"));
+  client.println(F("      if (data.datetime) {"));
+  client.println(F("        document.getElementById('datetime').textContent = 'Last updated: ' + data.datetime;"));
+  client.println(F("      }"));
+  client.println(F("    });"));
+  client.println('}');
+  client.println(F("updateDashboard();"));
+  client.println(F("setInterval(updateDashboard, 2000);"));
+  client.println(F("</script>"));
+  client.println(F("</body>"));
+  client.println(F("</html>"));
+}
+
+void sendCurrentData(EthernetClient& client) {
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  client.print(F("{\"timestamp\":"));
+  client.print(getUTCTimestamp());
+  client.print(F(",\"timestamp_ms\":"));
+  printUint64(client, epochMillis());
+  client.print(F(",\"datetime\":\""));
+  client.print(getUSLocalTimeString());
+  client.print(F("\",\"boot\":"));
+  client.print(bootId);
+  client.print(F(",\"avcc_mv\":"));
+  client.print(avccMillivolts);
+  client.print(F(",\"scan_tick\":"));
+  client.print(scanTiming.startTick);
+  client.print(F(",\"scan_skew_us\":"));
+  client.print(scanTiming.skewUs);
+  client.print(F(",\"banks\":["));
+  for (uint8_t b = 0; b < bankCount(); b++) {
+    const BankState& bank = banks[b];
+    if (b > 0) client.print(',');
+    client.print(F("{\"id\":"));
+    client.print(b + 1);
+    client.print(F(",\"cells\":"));
+    client.print(bank.cells);
+    client.print(F(",\"faults\":"));
+    client.print(bank.faults);
+    if (bank.cells > 0) {
+      // The total is only meaningful with every cell in it
+      if (bank.faults == 0) {
+        client.print(F(",\"voltage\":"));
+        client.print(bank.totalMv * 0.001, 3);
+      }
+      client.print(F(",\"spread_mv\":"));
+      client.print(bank.maxMv - bank.minMv);
+      client.print(F(",\"worst\":"));
+      client.print(bank.worst + 1);
+    }
+    client.print(F(",\"alarm\":"));
+    client.print(bank.alarm ? F("true") : F("false"));
+    client.print('}');
+  }
+  client.print(F("],\"batteries\":["));
+
+  for (int i = 0; i < config.numBatteries; i++) {
+    client.print('{');
+    client.print(F("\"id\":"));
+    client.print(i + 1);
+    client.print(F(",\"raw\":"));
+    client.print(batteries[i].rawValue);
+    client.print(F(",\"voltage\":"));
+    client.print(batteries[i].voltage, 3);
+    client.print(F(",\"percentage\":"));
+    client.print(batteries[i].percentage, 1);
+    uint8_t fault = channelFaults[i].fault;
+    client.print(F(",\"healthy\":"));
+    client.print(fault != FAULT_NONE ? F("null") : batteries[i].isHealthy ? F("true") : F("false"));
+    client.print(F(",\"fault\":"));
+    if (fault != FAULT_NONE) {
+      client.print('"');
+      client.print((const __FlashStringHelper*)FAULT_NAMES[fault]);
+      client.print('"');
+    } else {
+      client.print(F("null"));
+    }
+    client.print(F(",\"over_range\":"));
+    client.print(batteries[i].overRange ? F("true") : F("false"));
+    client.print(F(",\"drop_warning\":"));
+    client.print(dropDetectors[i].warning ? F("true") : F("false"));
+    client.print('}');
+    if (i < config.numBatteries - 1) client.print(',');
+  }
+
+  client.println(F("]}"));
+}
+
+// Today's percentiles so far, straight from the estimators, and yesterday's
+// final ones as appended to DAILY_SUMMARY_FILE
+void sendStats(EthernetClient& client) {
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  client.print(F("{\"interval_ms\":"));
+  client.print(STATS_SAMPLE_INTERVAL);
+  client.print(F(",\"today\":"));
+  sendStatsDayHeader(client, statsDay, statsSamples);
+  for (uint8_t i = 0; i < config.numBatteries && statsSamples > 0; i++) {
+    const ChannelQuantiles& q = quantiles[i];
+    if (i > 0) client.print(',');
+    client.print(F("{\"id\":"));
+    client.print(i + 1);
+    client.print(F(",\"samples\":"));
+    client.print(q.samples);
+    for (uint8_t j = 0; j < DAILY_STAT_COUNT && q.samples > 0; j++) {
+      client.print(F(",\""));
+      client.print((const __FlashStringHelper*)DAILY_STAT_NAMES[j]);
+      client.print(F("\":"));
+      client.print(dailyStatMillivolts(q, q.samples, j) * 0.001, 3);
+    }
+    client.print('}');
+  }
+  client.print(F("]}"));
+
+  client.print(F(",\"yesterday\":"));
+  if (yesterdayDay != 0) {
+    sendStatsYesterday(client);
+  } else {
+    client.print(F("null"));
+  }
+  client.println('}');
+}
+
+// Opens a day object up to the start of its "batteries" array
+void sendStatsDayHeader(EthernetClient& client, uint16_t day, uint16_t samples) {
+  client.print(F("{\"date\":"));
+  if (day != 0) {
+    char date[11];
+    formatDay(day, date);
+    client.print('"');
+    client.print(date);
+    client.print('"');
+  } else {
+    client.print(F("null"));
+  }
+  client.print(F(",\"samples\":"));
+  client.print(samples);
+  client.print(F(",\"batteries\":["));
+}
+
+// Yesterday's per-battery figures are not kept in RAM. They are read back
+// from the last lines of DAILY_SUMMARY_FILE, whose voltage fields are
+// already in the JSON's format.
+void sendStatsYesterday(EthernetClient& client) {
+  sendStatsDayHeader(client, yesterdayDay, yesterdaySamples);
+
+  File summary;
+  if (yesterdaySamples > 0) summary = SD.open(DAILY_SUMMARY_FILE);
+  if (summary) {
+    char date[11];
+    formatDay(yesterdayDay, date);
+
+    char line[DAILY_LINE_MAX];
+    uint32_t span = (uint32_t)MAX_BATTERIES * DAILY_LINE_MAX;
+    if (summary.size() > span) {
+      summary.seek(summary.size() - span);
+      summary.readBytesUntil('\n', line, sizeof(line)); // Skip the partial line
+    }
+
+    bool first = true;
+    while (summary.available()) {
+      uint8_t length = summary.readBytesUntil('\n', line, sizeof(line) - 1);
+      line[length] = '\0';
+      if (strncmp(line, date, 10) != 0 || line[10] != ',') continue;
+
+      // Battery,Samples, then one field per DAILY_STAT_NAMES (empty with no samples)
+      char* id = strtok(line + 11, ",\r");
+      char* samples = strtok(NULL, ",\r");
+      if (id == NULL || samples == NULL) continue;
+      if (!first) client.print(',');
+      first = false;
+      client.print(F("{\"id\":"));
+      client.print(id);
+      client.print(F(",\"samples\":"));
+      client.print(samples);
+      for (uint8_t j = 0; j < DAILY_STAT_COUNT; j++) {
+        char* value = strtok(NULL, ",\r");
+        if (value == NULL) break;
+        client.print(F(",\""));
+        client.print((const __FlashStringHelper*)DAILY_STAT_NAMES[j]);
+        client.print(F("\":"));
+        client.print(value);
+      }
+      client.print('}');
+    }
+    summary.close();
+  }
+  client.print(F("]}"));
+}
+
+#if TRACE_ENABLED
+void traceRecord(uint8_t id, char phase, uint16_t arg) {
+  TraceEvent& event = traceRing[traceHead];
+  event.us = micros();
+  event.id = id;
+  event.phase = phase;
+  event.arg = arg;
+  traceHead = (traceHead + 1) % TRACE_RING_SIZE;
+  if (traceCount < TRACE_RING_SIZE) traceCount++;
+}
+
+// Chrome trace JSON of the ring, oldest event first with times relative to
+// it. An end whose begin has already been overwritten is dropped by the
+// viewer. Events recorded while this runs are not included.
+void writeTraceJson(Print& out) {
+  uint8_t count = traceCount;
+  uint8_t first = (traceHead + TRACE_RING_SIZE - count) % TRACE_RING_SIZE;
+  uint32_t origin = count > 0 ? traceRing[first].us : 0;
+
+  out.print(F("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+  for (uint8_t task = 0; task < TASK_COUNT; task++) {
+    out.print(F("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"));
+    out.print(task);
+    out.print(F(",\"args\":{\"name\":\""));
+    out.print((const __FlashStringHelper*)TASK_NAMES[task]);
+    out.print(F("\"}},"));
+  }
+  for (uint8_t n = 0; n < count; n++) {
+    const TraceEvent& event = traceRing[(first + n) % TRACE_RING_SIZE];
+    if (n > 0) out.print(',');
+    out.print(F("{\"name\":\""));
+    out.print((const __FlashStringHelper*)TRACE_EVENT_NAMES[event.id]);
+    out.print(F("\",\"ph\":\""));
+    out.print(event.phase);
+    out.print(F("\",\"ts\":"));
+    out.print(event.us - origin);
+    out.print(F(",\"pid\":1,\"tid\":"));
+    out.print(TRACE_EVENT_TASK[event.id]);
+    if (event.phase == 'i') out.print(F(",\"s\":\"t\""));
+    out.print(F(",\"args\":{\"arg\":"));
+    out.print(event.arg);
+    out.print(F("}}"));
+  }
+  out.println(F("]}"));
+}
+#endif
+
+void sendTrace(EthernetClient& client) {
+#if TRACE_ENABLED
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+  writeTraceJson(client);
+#else
+  client.println(F("HTTP/1.1 404 Not Found"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+  client.println(F("{\"error\":\"tracing not compiled in (build with -DTRACE_ENABLED=1)\"}"));
+#endif
+}
+
+// /api/history is streamed: beginHistoryData() sends the preamble and opens
+// the log, then each continueHistoryData() call either verifies part of the
+// next block or sends up to HISTORY_CHUNK_RECORDS of its records, and returns
+// true once the response is done. Blocks that fail their CRC are skipped.
+void beginHistoryData(HttpConnection& conn) {
+  EthernetClient& client = conn.client;
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  client.println(F("{\"history\":["));
+
+  char formatText[4];
+  conn.isoTimes = getQueryParam(httpRequestLine, PSTR("format"), formatText, sizeof(formatText)) &&
+                  strcmp_P(formatText, PSTR("iso")) == 0;
+  releaseRequestLine(conn);
+  conn.firstRecord = true;
+  resetHistoryRepeats(conn);
+  conn.lastBoot = 0;
+  memset(&conn.blocks, 0, sizeof(conn.blocks));
+  resetLogBlockScanner(conn.scanner);
+  conn.blockEnd = 0;
+  conn.scanBytes = 0;
+  conn.segment = oldestLogSegment;
+  conn.file = openLogSegment(conn.segment, conn.logFormat, conn.logBatteries);
+  if (conn.file) {
+    conn.blockStart = conn.file.position();
+  }
+}
+
+bool continueHistoryData(HttpConnection& conn) {
+  EthernetClient& client = conn.client;
+
+  // Expand an R line a chunk at a time, re-reading the repeated record
+  if (conn.repeatsLeft > 0) {
+    uint32_t resume = conn.file.position();
+    conn.file.seek(conn.lastRecordPos);
+    String line = conn.file.readStringUntil('\n');
+    line.trim();
+    conn.file.seek(resume);
+    for (uint8_t records = 0; conn.repeatsLeft > 0 && records < HISTORY_CHUNK_RECORDS; records++) {
+      conn.repeatShift += conn.repeatInterval;
+      conn.repeatsLeft--;
+      if (historyRecordIsCopy(conn, line, conn.repeatShift)) continue;
+      client.print(',');
+      sendHistoryRecord(client, line, conn.logFormat, conn.logBatteries, conn.isoTimes, conn.repeatShift);
+    }
+    return false;
+  }
+
+  if (conn.file && conn.blockEnd == 0) {
+    uint8_t result = scanLogChunk(conn.file, conn.scanner);
+    if (result == BLOCK_NONE) return false;
+
+    // A void block is a failed write's fragment: dropped without counting,
+    // and the last record before it is still the one any R line repeats
+    if (result == BLOCK_CORRUPT || result == BLOCK_VOID || (result != BLOCK_END && conn.scanner.bytes == 0)) {
+      if (result == BLOCK_CORRUPT) {
+        logBlocksSkipped++;
+        conn.blocks.corrupt++;
+        resetHistoryRepeats(conn); // A run after this block would repeat the wrong record
+      }
+      conn.blockStart = conn.file.position();
+      resetLogBlockScanner(conn.scanner);
+      return false;
+    }
+
+    if (result != BLOCK_END) {
+      // Verified (or an unchecked tail): go back and send its records
+      conn.blockEnd = conn.blockStart + conn.scanner.bytes;
+      conn.file.seek(conn.blockStart);
+      return false;
+    }
+  }
+
+  uint8_t records = 0;
+  while (conn.file && conn.file.position() < conn.blockEnd && records < HISTORY_CHUNK_RECORDS) {
+    uint32_t lineStart = conn.file.position();
+    String line = conn.file.readStringUntil('\n');
+    line.trim();
+
+    if (line.startsWith(F("R,"))) {
+      // Repeats of the last record, sent from the next call on
+      if (conn.lastRecordPos == 0) continue;
+      int comma = line.indexOf(',', 2);
+      conn.repeatsLeft = line.substring(2, comma).toInt();
+      conn.repeatInterval = strtoul(line.c_str() + comma + 1, NULL, 10);
+      break;
+    }
+
+    if (line.length() > 0) {
+      conn.lastRecordPos = lineStart; // Never 0: the header comes first
+      conn.repeatShift = 0;
+      records++;
+      if (historyRecordIsCopy(conn, line, 0)) continue;
+      if (!conn.firstRecord) client.print(',');
+      sendHistoryRecord(client, line, conn.logFormat, conn.logBatteries, conn.isoTimes, 0);
+      conn.firstRecord = false;
+    }
+  }
+
+  if (conn.file && conn.blockEnd > 0 && conn.file.position() >= conn.blockEnd) {
+    conn.file.readStringUntil('\n'); // Skip the trailer
+    conn.blockStart = conn.file.position();
+    conn.blockEnd = 0;
+    resetLogBlockScanner(conn.scanner);
+  }
+
+  if (conn.repeatsLeft > 0) return false;
+  if (conn.file && conn.file.available()) return false;
+  if (conn.file && openNextLogSegment(conn)) return false;
+
+  client.print(F("],\"skipped_blocks\":"));
+  client.print(conn.blocks.corrupt);
+  client.println('}');
+  return true;
+}
+
+// /api/verify checks every block of every log segment against its CRC
+// without parsing the records, reading LOG_SCAN_CHUNK bytes at a time.
+void beginLogVerify(HttpConnection& conn) {
+  releaseRequestLine(conn);
+  conn.scanStart = millis();
+  memset(&conn.blocks, 0, sizeof(conn.blocks));
+  resetLogBlockScanner(conn.scanner);
+  conn.scanBytes = 0;
+  conn.segment = oldestLogSegment;
+  conn.file = openLogSegment(conn.segment, conn.logFormat, conn.logBatteries);
+}
+
+bool continueLogVerify(HttpConnection& conn) {
+  if (conn.file) {
+    uint8_t result = scanLogChunk(conn.file, conn.scanner);
+    if (result == BLOCK_NONE) return false;
+    if (result != BLOCK_END) {
+      countLogBlock(conn.blocks, conn.scanner, result);
+      resetLogBlockScanner(conn.scanner);
+      return false;
+    }
+    if (openNextLogSegment(conn)) return false;
+  }
+
+  EthernetClient& client = conn.client;
+  LogBlockStats& stats = conn.blocks;
+  if (conn.scanBytes == 0) {
+    conn.status = 503;
+    client.println(F("HTTP/1.1 503 Service Unavailable"));
+    client.println(F("Content-Type: text/plain"));
+    client.println(F("Connection: close"));
+    client.println();
+    client.println(F("Log file not available"));
+    return true;
+  }
+
+  logVerifyCorrupt = stats.corrupt;
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+  client.print(F("{\"ok\":"));
+  client.print(stats.corrupt == 0 && stats.sequenceGaps == 0 ? F("true") : F("false"));
+  client.print(F(",\"bytes\":"));
+  client.print(conn.scanBytes);
+  client.print(F(",\"segments\":"));
+  client.print(activeLogSegment - oldestLogSegment + 1);
+  client.print(F(",\"blocks\":"));
+  client.print(stats.valid + stats.corrupt + stats.unsealed + stats.voided);
+  client.print(F(",\"valid\":"));
+  client.print(stats.valid);
+  client.print(F(",\"corrupt\":"));
+  client.print(stats.corrupt);
+  client.print(F(",\"unsealed\":"));
+  client.print(stats.unsealed);
+  client.print(F(",\"void\":"));
+  client.print(stats.voided);
+  client.print(F(",\"sequence_gaps\":"));
+  client.print(stats.sequenceGaps);
+  client.print(F(",\"next_seq\":"));
+  client.print(logBlockSeq);
+  client.print(F(",\"duration_ms\":"));
+  client.print(millis() - conn.scanStart);
+  client.println(F("}"));
+  return true;
+}
+
+// Forgets the record an R line would repeat
+void resetHistoryRepeats(HttpConnection& conn) {
+  conn.lastRecordPos = 0;
+  conn.repeatsLeft = 0;
+  conn.repeatShift = 0;
+}
+
+// A reset in the middle of flushSamples() leaves records on the card that are
+// written again at boot. Ticks only grow within a boot, so a record that is
+// not past the newest (boot, tick) already sent is such a copy.
+bool historyRecordIsCopy(HttpConnection& conn, const String& line, uint32_t shiftMs) {
+  if (!(conn.logFormat & LOG_FORMAT_BOOT_TICK)) return false;
+
+  char* end;
+  uint32_t boot = strtoul(line.c_str() + line.indexOf(',') + 1, &end, 10);
+  uint32_t tick = strtoul(end + 1, NULL, 10) + shiftMs;
+  if (boot == conn.lastBoot && (int32_t)(tick - conn.lastTick) <= 0) return true;
+
+  conn.lastBoot = boot;
+  conn.lastTick = tick;
+  return false;
+}
+
+// Epoch segments give timestamp_ms, plus the ISO text when isoTimes is set;
+// older segments give the ISO text as stored. shiftMs moves the record's
+// times later, for the repeats of an R line.
+void sendHistoryRecord(EthernetClient& client, const String& line, uint8_t format, uint8_t batteries, bool isoTimes, uint32_t shiftMs) {
+  int commaIndex = line.indexOf(',');
+  String timestamp;
+  uint64_t epochMs = 0;
+  if (format & LOG_FORMAT_EPOCH) epochMs = parseUint64(line.c_str(), NULL);
+  else timestamp = line.substring(0, commaIndex);
+  String data = line.substring(commaIndex + 1);
+
+  uint32_t boot = 0;
+  uint32_t tick = 0;
+  bool backdated = false;
+  if (format & LOG_FORMAT_BOOT_TICK) {
+    boot = data.toInt();
+    commaIndex = data.indexOf(',');
+    tick = strtoul(data.c_str() + commaIndex + 1, NULL, 10) + shiftMs;
+    data = data.substring(data.indexOf(',', commaIndex + 1) + 1);
+
+    // Taken before the clock was set: date it from its boot's first sync
+    bool unset = (format & LOG_FORMAT_EPOCH) ? epochMs == 0 : timestamp.startsWith(F("1970"));
+    ClockMapping mapping;
+    if (unset && findClockMapping(boot, mapping)) {
+      epochMs = epochFromTick(mapping, tick);
+      if (!(format & LOG_FORMAT_EPOCH)) timestamp = getDateTimeForCSV(epochMs);
+      backdated = true;
+    }
+  }
+  if (shiftMs > 0 && !backdated) {
+    if (format & LOG_FORMAT_EPOCH) {
+      if (epochMs != 0) epochMs += shiftMs;
+    } else if (!timestamp.startsWith(F("1970"))) {
+      timestamp = getDateTimeForCSV(parseIsoTimestamp(timestamp.c_str()) + shiftMs);
+    }
+  }
+
+  client.print('{');
+  if (format & LOG_FORMAT_EPOCH) {
+    client.print(F("\"timestamp_ms\":"));
+    printUint64(client, epochMs);
+    if (isoTimes) {
+      client.print(F(",\"timestamp\":\""));
+      client.print(getDateTimeForCSV(epochMs));
+      client.print('"');
+    }
+  } else {
+    client.print(F("\"timestamp\":\""));
+    client.print(timestamp);
+    client.print('"');
+  }
+  if (format & LOG_FORMAT_BOOT_TICK) {
+    client.print(F(",\"boot\":"));
+    client.print(boot);
+    client.print(F(",\"tick\":"));
+    client.print(tick);
+    if (backdated) client.print(F(",\"backdated\":true"));
+  }
+
+  int startIndex = 0;
+  int32_t avccMv = 0;
+  if (format & LOG_FORMAT_RAW_ONLY) {
+    int nextComma = data.indexOf(',');
+    client.print(F(",\"cal\":"));
+    client.print(data.substring(0, nextComma));
+    avccMv = strtol(data.c_str() + nextComma + 1, NULL, 10);
+    startIndex = data.indexOf(',', nextComma + 1) + 1;
+  }
+  client.print(F(",\"data\":["));
+
+  int batteryIndex = 0;
+
+  if (batteries == 0 || batteries > MAX_BATTERIES) batteries = MAX_BATTERIES;
+  while (startIndex < (int)data.length() && batteryIndex < batteries) {
+    if (batteryIndex > 0) client.print(',');
+
+    // Raw value
+    int nextComma = data.indexOf(',', startIndex);
+    if (nextComma == -1) nextComma = data.length();
+    String rawValue = data.substring(startIndex, nextComma);
+    startIndex = nextComma + 1;
+
+    if (format & LOG_FORMAT_RAW_ONLY) {
+      // Derived with the current calibration, so recalibration applies to old records too
+      int32_t millivolts = rawToMillivoltsAt(batteryIndex, rawValue.toInt(), avccMv);
+      client.print(F("{\"raw\":"));
+      client.print(rawValue);
+      client.print(F(",\"voltage\":"));
+      client.print(millivolts * 0.001, 3);
+      client.print(F(",\"percentage\":"));
+      client.print(millivoltsToPercentage(millivolts), 1);
+      client.print('}');
+      batteryIndex++;
+      continue;
+    }
+
+    // Voltage
+    nextComma = data.indexOf(',', startIndex);
+    String voltage = data.substring(startIndex, nextComma);
+    startIndex = nextComma + 1;
+
+    // Percentage
+    nextComma = data.indexOf(',', startIndex);
+    if (nextComma == -1) nextComma = data.length();
+    String percentage = data.substring(startIndex, nextComma);
+    startIndex = nextComma + 1;
+
+    client.print(F("{\"raw\":"));
+    client.print(rawValue);
+    client.print(F(",\"voltage\":"));
+    client.print(voltage);
+    client.print(F(",\"percentage\":"));
+    client.print(percentage);
+    client.print('}');
+
+    batteryIndex++;
+  }
+  client.print(']');
+
+  if (format & LOG_FORMAT_BANKS) {
+    // Voltage, spread and weakest battery per bank; all empty for a bank without cells
+    client.print(F(",\"banks\":["));
+    for (uint8_t b = 0; startIndex < (int)data.length(); b++) {
+      String fields[3];
+      for (uint8_t f = 0; f < 3; f++) {
+        int nextComma = data.indexOf(',', startIndex);
+        if (nextComma == -1) nextComma = data.length();
+        fields[f] = data.substring(startIndex, nextComma);
+        startIndex = nextComma + 1;
+      }
+
+      if (b > 0) client.print(',');
+      if (fields[0].length() == 0) {
+        client.print(F("null"));
+        continue;
+      }
+      client.print(F("{\"voltage\":"));
+      client.print(fields[0]);
+      client.print(F(",\"spread_mv\":"));
+      client.print(fields[1]);
+      client.print(F(",\"worst\":"));
+      client.print(fields[2]);
+      client.print('}');
+    }
+    client.print(']');
+  }
+
+  client.print('}');
+}
+
+void send404(EthernetClient& client) {
+  client.println(F("HTTP/1.1 404 Not Found"));
+  client.println(F("Content-Type: text/html"));
+  client.println(F("Connection: close"));
+  client.println();
+  client.println(F("<h1>404 - Not Found</h1>"));
+}
+
+void send429(EthernetClient& client, uint16_t retryAfter) {
+  client.println(F("HTTP/1.1 429 Too Many Requests"));
+  client.print(F("Retry-After: "));
+  client.println(retryAfter);
+  client.println(F("Content-Type: text/plain"));
+  client.println(F("Connection: close"));
+  client.println();
+  client.println(F("Rate limit exceeded"));
+}
+
+void send503(EthernetClient& client) {
+  client.println(F("HTTP/1.1 503 Service Unavailable"));
+  client.println(F("Retry-After: 1"));
+  client.println(F("Content-Type: text/plain"));
+  client.println(F("Connection: close"));
+  client.println();
+  client.println(F("Too many connections"));
+}
+
+// Access log and latency histograms
+void recordAccess(MeteredClient& client, uint32_t clientIP, uint8_t route, uint16_t status, unsigned long startTime) {
+  unsigned long now = millis();
+  uint32_t duration = now - startTime;
+  uint32_t ttfb = client.bytesSent > 0 ? client.firstByteTime - startTime : duration;
+
+  AccessRecord& record = accessLog[accessLogNext];
+  record.clientIP = clientIP;
+  record.startTime = startTime;
+  record.bytesSent = client.bytesSent;
+  record.ttfbMs = min(ttfb, (uint32_t)0xFFFF);
+  record.durationMs = min(duration, (uint32_t)0xFFFF);
+  record.status = status;
+  record.route = route;
+  accessLogNext = (accessLogNext + 1) % ACCESS_LOG_SIZE;
+  accessLogTotal++;
+  counters.requests++;
+  sealBlock(counters);
+
+  RouteStats& stats = routeStats[route];
+  uint8_t bucket = 0;
+  while (bucket < LATENCY_BUCKET_COUNT && duration > pgm_read_word(&LATENCY_BUCKETS_MS[bucket])) bucket++;
+  stats.buckets[bucket]++;
+  stats.count++;
+  stats.durationMsSum += duration;
+  stats.ttfbMsSum += ttfb;
+  stats.bytesSent += client.bytesSent;
+}
+
+const __FlashStringHelper* routeName(uint8_t route) {
+  return reinterpret_cast<const __FlashStringHelper*>(pgm_read_ptr(&ROUTE_NAMES[route]));
+}
+
+void sendAccessLog(EthernetClient& client) {
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  client.print(F("{\"total\":"));
+  client.print(counters.requests);
+  client.print(F(",\"requests\":["));
+
+  // Newest first; the request being served is not in the ring yet
+  uint8_t count = min(accessLogTotal, (uint32_t)ACCESS_LOG_SIZE);
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < count; i++) {
+    const AccessRecord& record = accessLog[(accessLogNext + ACCESS_LOG_SIZE - 1 - i) % ACCESS_LOG_SIZE];
+    if (i > 0) client.print(F(","));
+    client.print(F("{\"client\":\""));
+    client.print(IPAddress(record.clientIP));
+    client.print(F("\",\"route\":\""));
+    client.print(routeName(record.route));
+    client.print(F("\",\"status\":"));
+    client.print(record.status);
+    client.print(F(",\"bytes\":"));
+    client.print(record.bytesSent);
+    client.print(F(",\"ttfb_ms\":"));
+    client.print(record.ttfbMs);
+    client.print(F(",\"duration_ms\":"));
+    client.print(record.durationMs);
+    client.print(F(",\"age_ms\":"));
+    client.print(now - record.startTime);
+    client.print(F("}"));
+  }
+
+  client.println(F("]}"));
+}
+
+// Prometheus text exposition of the per-route request histograms
+void sendMetrics(EthernetClient& client) {
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: text/plain; version=0.0.4"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  client.println(F("# HELP battery_http_request_duration_seconds Time from accept to connection close."));
+  client.println(F("# TYPE battery_http_request_duration_seconds histogram"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++) {
+    const RouteStats& stats = routeStats[route];
+    uint32_t cumulative = 0;
+    for (uint8_t bucket = 0; bucket <= LATENCY_BUCKET_COUNT; bucket++) {
+      cumulative += stats.buckets[bucket];
+      client.print(F("battery_http_request_duration_seconds_bucket{route=\""));
+      client.print(routeName(route));
+      client.print(F("\",le=\""));
+      if (bucket < LATENCY_BUCKET_COUNT) {
+        client.print(pgm_read_word(&LATENCY_BUCKETS_MS[bucket]) / 1000.0, 3);
+      } else {
+        client.print(F("+Inf"));
+      }
+      client.print(F("\"} "));
+      client.println(cumulative);
+    }
+    client.print(F("battery_http_request_duration_seconds_sum{route=\""));
+    client.print(routeName(route));
+    client.print(F("\"} "));
+    client.println(stats.durationMsSum / 1000.0, 3);
+    client.print(F("battery_http_request_duration_seconds_count{route=\""));
+    client.print(routeName(route));
+    client.print(F("\"} "));
+    client.println(stats.count);
+  }
+
+  client.println(F("# HELP battery_http_ttfb_seconds_total Cumulative time to first response byte."));
+  client.println(F("# TYPE battery_http_ttfb_seconds_total counter"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++) {
+    client.print(F("battery_http_ttfb_seconds_total{route=\""));
+    client.print(routeName(route));
+    client.print(F("\"} "));
+    client.println(routeStats[route].ttfbMsSum / 1000.0, 3);
+  }
+
+  client.println(F("# HELP battery_last_reset Cause of the last reset and the task that stalled, if any."));
+  client.println(F("# TYPE battery_last_reset gauge"));
+  client.print(F("battery_last_reset{cause=\""));
+  client.print(lastResetCause);
+  client.print(F("\",stalled_task=\""));
+  if (lastStalledTask < TASK_COUNT) client.print((const __FlashStringHelper*)TASK_NAMES[lastStalledTask]);
+  client.println(F("\"} 1"));
+  client.println(F("# HELP battery_watchdog_resets_total Watchdog resets since power-on."));
+  client.println(F("# TYPE battery_watchdog_resets_total counter"));
+  client.print(F("battery_watchdog_resets_total "));
+  client.println(watchdogState.watchdogResets);
+
+  client.println(F("# HELP battery_log_repaired_bytes Bytes of partial record removed from the log at boot."));
+  client.println(F("# TYPE battery_log_repaired_bytes gauge"));
+  client.print(F("battery_log_repaired_bytes "));
+  client.println(logRepairedBytes);
+  if (sdRawReady) {
+    uint32_t clusterBytes = sdVolume.blocksPerCluster() * 512UL;
+    client.println(F("# HELP battery_sd_capacity_bytes Size of the SD card's data area."));
+    client.println(F("# TYPE battery_sd_capacity_bytes gauge"));
+    client.print(F("battery_sd_capacity_bytes "));
+    printUint64(client, (uint64_t)sdVolume.clusterCount() * clusterBytes);
+    client.println();
+    if (sdFreeKnown) {
+      client.println(F("# HELP battery_sd_free_bytes Free space on the SD card."));
+      client.println(F("# TYPE battery_sd_free_bytes gauge"));
+      client.print(F("battery_sd_free_bytes "));
+      printUint64(client, (uint64_t)sdFreeClusters * clusterBytes);
+      client.println();
+    }
+  }
+  client.println(F("# HELP battery_log_segments Log segments on the SD card."));
+  client.println(F("# TYPE battery_log_segments gauge"));
+  client.print(F("battery_log_segments "));
+  client.println(activeLogSegment - oldestLogSegment + 1);
+  client.println(F("# HELP battery_log_segments_pruned_total Old log segments deleted to free space."));
+  client.println(F("# TYPE battery_log_segments_pruned_total counter"));
+  client.print(F("battery_log_segments_pruned_total "));
+  client.println(logSegmentsPruned);
+  client.println(F("# HELP battery_log_blocks_skipped_total Corrupt log blocks left out of /api/history."));
+  client.println(F("# TYPE battery_log_blocks_skipped_total counter"));
+  client.print(F("battery_log_blocks_skipped_total "));
+  client.println(logBlocksSkipped);
+  if (logVerifyCorrupt >= 0) {
+    client.println(F("# HELP battery_log_verify_corrupt_blocks Corrupt log blocks found by the last /api/verify scan."));
+    client.println(F("# TYPE battery_log_verify_corrupt_blocks gauge"));
+    client.print(F("battery_log_verify_corrupt_blocks "));
+    client.println(logVerifyCorrupt);
+  }
+
+  unsigned long linkDownMs = networkStats.linkDownMs + (linkUp ? 0 : millis() - linkDownSince);
+  client.println(F("# HELP battery_network_link_up Whether the Ethernet link is up."));
+  client.println(F("# TYPE battery_network_link_up gauge"));
+  client.print(F("battery_network_link_up "));
+  client.println(linkUp ? 1 : 0);
+  client.println(F("# HELP battery_network_dhcp Whether the address comes from a DHCP lease (0 = fallback address)."));
+  client.println(F("# TYPE battery_network_dhcp gauge"));
+  client.print(F("battery_network_dhcp "));
+  client.println(usingDhcp ? 1 : 0);
+  client.println(F("# HELP battery_network_link_down_total Ethernet link losses."));
+  client.println(F("# TYPE battery_network_link_down_total counter"));
+  client.print(F("battery_network_link_down_total "));
+  client.println(networkStats.linkDowns);
+  client.println(F("# HELP battery_network_link_down_seconds_total Time spent without an Ethernet link."));
+  client.println(F("# TYPE battery_network_link_down_seconds_total counter"));
+  client.print(F("battery_network_link_down_seconds_total "));
+  client.println(linkDownMs / 1000.0, 3);
+  client.println(F("# HELP battery_network_dhcp_renewals_total Successful DHCP lease renewals and rebinds."));
+  client.println(F("# TYPE battery_network_dhcp_renewals_total counter"));
+  client.print(F("battery_network_dhcp_renewals_total "));
+  client.println(networkStats.dhcpRenewals);
+  client.println(F("# HELP battery_network_dhcp_failures_total Failed DHCP requests, renewals and rebinds."));
+  client.println(F("# TYPE battery_network_dhcp_failures_total counter"));
+  client.print(F("battery_network_dhcp_failures_total "));
+  client.println(networkStats.dhcpFailures);
+  client.println(F("# HELP battery_network_address_changes_total Times the device's IP address changed."));
+  client.println(F("# TYPE battery_network_address_changes_total counter"));
+  client.print(F("battery_network_address_changes_total "));
+  client.println(networkStats.addressChanges);
+  client.println(F("# HELP battery_mdns_announcements_total mDNS responder (re)starts announcing the device."));
+  client.println(F("# TYPE battery_mdns_announcements_total counter"));
+  client.print(F("battery_mdns_announcements_total "));
+  client.println(networkStats.mdnsAnnouncements);
+  client.println(F("# HELP battery_mdns_busy_seconds_total Time spent answering mDNS traffic."));
+  client.println(F("# TYPE battery_mdns_busy_seconds_total counter"));
+  client.print(F("battery_mdns_busy_seconds_total "));
+  client.println(networkStats.mdnsBusyUs / 1000000.0, 3);
+  client.println(F("# HELP battery_mdns_budget_exhausted_total Responder ticks that ran out of time."));
+  client.println(F("# TYPE battery_mdns_budget_exhausted_total counter"));
+  client.print(F("battery_mdns_budget_exhausted_total "));
+  client.println(networkStats.mdnsBudgetExhausted);
+  client.println(F("# HELP battery_mdns_packets_dropped_total mDNS packets discarded unanswered when the budget ran out."));
+  client.println(F("# TYPE battery_mdns_packets_dropped_total counter"));
+  client.print(F("battery_mdns_packets_dropped_total "));
+  client.println(networkStats.mdnsDropped);
+
+  client.println(F("# HELP battery_boot_id Boot counter, also logged with every record."));
+  client.println(F("# TYPE battery_boot_id gauge"));
+  client.print(F("battery_boot_id "));
+  client.println(bootId);
+  client.println(F("# HELP battery_clock_steps_total NTP updates that stepped the clock by 500 ms or more."));
+  client.println(F("# TYPE battery_clock_steps_total counter"));
+  client.print(F("battery_clock_steps_total "));
+  client.println(clockSteps);
+  client.println(F("# HELP battery_ntp_round_trip_seconds Round trip of the last NTP exchange (bounds the clock error)."));
+  client.println(F("# TYPE battery_ntp_round_trip_seconds gauge"));
+  client.print(F("battery_ntp_round_trip_seconds "));
+  client.println(ntpRoundTripMs / 1000.0, 3);
+  client.println(F("# HELP battery_ntp_failures_total NTP requests that could not be sent or got no reply."));
+  client.println(F("# TYPE battery_ntp_failures_total counter"));
+  client.print(F("battery_ntp_failures_total "));
+  client.println(ntpFailures);
+
+  client.println(F("# HELP battery_avcc_millivolts Measured ADC reference (supply) voltage."));
+  client.println(F("# TYPE battery_avcc_millivolts gauge"));
+  client.print(F("battery_avcc_millivolts "));
+  client.println(avccMillivolts);
+  client.println(F("# HELP battery_scan_skew_seconds Time between the first and last channel of the latest scan."));
+  client.println(F("# TYPE battery_scan_skew_seconds gauge"));
+  client.print(F("battery_scan_skew_seconds "));
+  client.println(scanTiming.skewUs / 1000000.0, 6);
+  client.println(F("# HELP battery_scan_skew_max_seconds Largest scan skew since boot."));
+  client.println(F("# TYPE battery_scan_skew_max_seconds gauge"));
+  client.print(F("battery_scan_skew_max_seconds "));
+  client.println(scanTiming.maxSkewUs / 1000000.0, 6);
+
+  uint8_t bankTotal = bankCount();
+  if (bankTotal > 0) {
+    client.println(F("# HELP battery_bank_voltage_volts Sum of the cell voltages in each bank."));
+    client.println(F("# TYPE battery_bank_voltage_volts gauge"));
+    for (uint8_t b = 0; b < bankTotal; b++) {
+      client.print(F("battery_bank_voltage_volts{bank=\""));
+      client.print(b + 1);
+      client.print(F("\"} "));
+      if (banks[b].faults > 0) client.println(F("NaN"));
+      else client.println(banks[b].totalMv * 0.001, 3);
+    }
+    client.println(F("# HELP battery_bank_spread_volts Highest minus lowest cell voltage in each bank."));
+    client.println(F("# TYPE battery_bank_spread_volts gauge"));
+    for (uint8_t b = 0; b < bankTotal; b++) {
+      client.print(F("battery_bank_spread_volts{bank=\""));
+      client.print(b + 1);
+      client.print(F("\"} "));
+      client.println(banks[b].cells > 0 ? (banks[b].maxMv - banks[b].minMv) * 0.001 : 0.0, 3);
+    }
+    client.println(F("# HELP battery_bank_imbalance_alarm 1 while the bank's spread is over the alarm limit."));
+    client.println(F("# TYPE battery_bank_imbalance_alarm gauge"));
+    for (uint8_t b = 0; b < bankTotal; b++) {
+      client.print(F("battery_bank_imbalance_alarm{bank=\""));
+      client.print(b + 1);
+      client.print(F("\"} "));
+      client.println(banks[b].alarm ? 1 : 0);
+    }
+  }
+  client.println(F("# HELP battery_bank_imbalance_alarms_total Bank imbalance alarms raised."));
+  client.println(F("# TYPE battery_bank_imbalance_alarms_total counter"));
+  client.print(F("battery_bank_imbalance_alarms_total "));
+  client.println(bankAlarms);
+  client.println(F("# HELP battery_log_run_samples_total Samples logged as repeats of the previous record (R lines)."));
+  client.println(F("# TYPE battery_log_run_samples_total counter"));
+  client.print(F("battery_log_run_samples_total "));
+  client.println(logRunSamples);
+  client.println(F("# HELP battery_voltage_drop_events_total Sudden voltage drops caught by the CUSUM detectors."));
+  client.println(F("# TYPE battery_voltage_drop_events_total counter"));
+  client.print(F("battery_voltage_drop_events_total "));
+  client.println(dropEvents);
+  client.println(F("# HELP battery_channel_fault Channel fault: 0 none, 1 open wire, 2 rail low, 3 noisy."));
+  client.println(F("# TYPE battery_channel_fault gauge"));
+  for (uint8_t i = 0; i < config.numBatteries; i++) {
+    client.print(F("battery_channel_fault{battery=\""));
+    client.print(i + 1);
+    client.print(F("\"} "));
+    client.println(channelFaults[i].fault);
+  }
+  client.println(F("# HELP battery_over_range Reading clamped at the top of the ADC range (battery at or above it)."));
+  client.println(F("# TYPE battery_over_range gauge"));
+  for (uint8_t i = 0; i < config.numBatteries; i++) {
+    client.print(F("battery_over_range{battery=\""));
+    client.print(i + 1);
+    client.print(F("\"} "));
+    client.println(batteries[i].overRange ? 1 : 0);
+  }
+  client.println(F("# HELP battery_channel_faults_total Channel faults raised."));
+  client.println(F("# TYPE battery_channel_faults_total counter"));
+  client.print(F("battery_channel_faults_total "));
+  client.println(faultEvents);
+
+  client.println(F("# HELP battery_http_rate_limited_total Requests rejected with 429."));
+  client.println(F("# TYPE battery_http_rate_limited_total counter"));
+  client.print(F("battery_http_rate_limited_total "));
+  client.println(counters.rateLimited);
+
+  client.println(F("# HELP battery_log_records_total Records written to the SD card."));
+  client.println(F("# TYPE battery_log_records_total counter"));
+  client.print(F("battery_log_records_total "));
+  client.println(counters.logRecords);
+  client.println(F("# HELP battery_log_records_dropped_total Samples lost before reaching the SD card."));
+  client.println(F("# TYPE battery_log_records_dropped_total counter"));
+  client.print(F("battery_log_records_dropped_total "));
+  client.println(counters.logRecordsDropped);
+  client.println(F("# HELP battery_log_records_pending Samples waiting to be written to the SD card."));
+  client.println(F("# TYPE battery_log_records_pending gauge"));
+  client.print(F("battery_log_records_pending "));
+  client.println(persistent.ring.count);
+  client.println(F("# HELP battery_warm_resets_total Resets after which runtime state was recovered."));
+  client.println(F("# TYPE battery_warm_resets_total counter"));
+  client.print(F("battery_warm_resets_total "));
+  client.println(counters.warmResets);
+
+  client.println(F("# HELP battery_http_response_bytes_total Response bytes sent."));
+  client.println(F("# TYPE battery_http_response_bytes_total counter"));
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++) {
+    client.print(F("battery_http_response_bytes_total{route=\""));
+    client.print(routeName(route));
+    client.print(F("\"} "));
+    client.println(routeStats[route].bytesSent);
+  }
+}
+
+// Persistent configuration
+//
+// config.json on the SD card is the editable copy; the EEPROM holds a binary
+// image of the same struct so the unit still boots with its site settings if
+// the card is missing or the file is damaged. Updates write EEPROM first and
+// the file second, so a power cut at any point leaves at least one complete,
+// CRC-valid copy of either the old or the new configuration.
+
+void setDefaultConfig(DeviceConfig& cfg) {
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.magic = CONFIG_MAGIC;
+  cfg.version = CONFIG_VERSION;
+  cfg.numBatteries = DEFAULT_NUM_BATTERIES;
+  cfg.logInterval = DEFAULT_LOG_INTERVAL;
+  cfg.displayUpdate = DEFAULT_DISPLAY_UPDATE;
+  cfg.timezoneOffset = DEFAULT_TIMEZONE_OFFSET;
+  strncpy_P(cfg.ntpServer, DEFAULT_NTP_SERVER, sizeof(cfg.ntpServer) - 1);
+  strncpy_P(cfg.deviceId, DEFAULT_DEVICE_ID, sizeof(cfg.deviceId) - 1);
+  memcpy(cfg.mac, DEFAULT_MAC, sizeof(cfg.mac));
+  cfg.logMode = LOG_MODE_FULL;
+  cfg.bankSpreadAlarmMv = DEFAULT_BANK_SPREAD_ALARM_MV;
+  cfg.cusumDriftMv = DEFAULT_CUSUM_DRIFT_MV;
+  cfg.cusumThresholdMv = DEFAULT_CUSUM_THRESHOLD_MV;
+}
+
+uint32_t configCrc(const DeviceConfig& cfg) {
+  return crc32Update(0, &cfg, offsetof(DeviceConfig, crc));
+}
+
+bool isConfigValid(const DeviceConfig& cfg) {
+  return cfg.magic == CONFIG_MAGIC && cfg.version == CONFIG_VERSION && cfg.crc == configCrc(cfg);
+}
+
+// Older images end where a later version added fields, and their CRC sits
+// there; the fields they lack take their defaults
+bool upgradeConfig(DeviceConfig& cfg) {
+  if (cfg.magic != CONFIG_MAGIC || cfg.version == 0 || cfg.version >= CONFIG_VERSION) return false;
+
+  uint8_t end = CONFIG_LAYOUT_END[cfg.version];
+  uint32_t crc;
+  memcpy(&crc, (uint8_t*)&cfg + end, sizeof(crc));
+  if (crc != crc32Update(0, &cfg, end)) return false;
+
+  DeviceConfig upgraded;
+  setDefaultConfig(upgraded);
+  memcpy(&upgraded, &cfg, end);
+  upgraded.version = CONFIG_VERSION;
+  upgraded.crc = configCrc(upgraded);
+  cfg = upgraded;
+  return true;
+}
+
+void loadConfig() {
+  DeviceConfig loaded;
+  setDefaultConfig(loaded);
+
+  File configFile = SD.open(CONFIG_FILE);
+  if (configFile) {
+    JsonDocument doc;
+    DeserializationError jsonError = deserializeJson(doc, configFile);
+    configFile.close();
+
+    const __FlashStringHelper* error = NULL;
+    if (jsonError) {
+      Serial.print(F("config.json is not valid JSON: "));
+      Serial.println(jsonError.f_str());
+    } else if (!parseConfigJson(doc, loaded, error)) {
+      Serial.print(F("config.json rejected: "));
+      Serial.println(error);
+    } else {
+      loaded.crc = configCrc(loaded);
+      config = loaded;
+      configSource = F("sd");
+      EEPROM.put(EEPROM_CONFIG_ADDR, config); // Keep the fallback image in step
+      return;
+    }
+  }
+
+  EEPROM.get(EEPROM_CONFIG_ADDR, loaded);
+  if (isConfigValid(loaded) || upgradeConfig(loaded)) {
+    config = loaded;
+    configSource = F("eeprom");
+    return;
+  }
+
+  setDefaultConfig(config);
+  config.crc = configCrc(config);
+  configSource = F("defaults");
+}
+
+bool parseMac(const char* text, byte* mac) {
+  for (uint8_t i = 0; i < 6; i++) {
+    char* end;
+    unsigned long octet = strtoul(text, &end, 16);
+    if (end == text || octet > 0xFF) return false;
+    if (i < 5 && *end != ':' && *end != '-') return false;
+    if (i == 5 && *end != '\0') return false;
+    mac[i] = octet;
+    text = end + 1;
+  }
+  return true;
+}
+
+// Applies the fields present in doc on top of cfg. Fields that are absent
+// keep their current value, so partial updates are allowed. On failure cfg
+// may be partially modified and error names the offending field. Keys and
+// messages stay in flash.
+bool parseConfigJson(JsonDocument& doc, DeviceConfig& cfg, const __FlashStringHelper*& error) {
+  JsonVariant field = doc[F("num_batteries")];
+  if (!field.isNull()) {
+    int value = field | 0;
+    if (value < 1 || value > MAX_BATTERIES) { error = F("num_batteries must be 1-16"); return false; }
+    cfg.numBatteries = value;
+  }
+  field = doc[F("log_interval_ms")];
+  if (!field.isNull()) {
+    uint32_t value = field | 0UL;
+    if (value < 1000) { error = F("log_interval_ms must be at least 1000"); return false; }
+    cfg.logInterval = value;
+  }
+  field = doc[F("display_update_ms")];
+  if (!field.isNull()) {
+    uint32_t value = field | 0UL;
+    if (value < 250 || value > 60000) { error = F("display_update_ms must be 250-60000"); return false; }
+    cfg.displayUpdate = value;
+  }
+  field = doc[F("timezone_offset_s")];
+  if (!field.isNull()) {
+    long value = field | 0L;
+    if (value < -12L * 3600 || value > 14L * 3600) { error = F("timezone_offset_s out of range"); return false; }
+    cfg.timezoneOffset = value;
+  }
+  field = doc[F("ntp_server")];
+  if (!field.isNull()) {
+    const char* value = field | "";
+    if (strlen(value) == 0 || strlen(value) >= sizeof(cfg.ntpServer)) { error = F("ntp_server must be 1-31 characters"); return false; }
+    strncpy(cfg.ntpServer, value, sizeof(cfg.ntpServer));
+  }
+  field = doc[F("device_id")];
+  if (!field.isNull()) {
+    const char* value = field | "";
+    size_t length = strlen(value);
+    if (length == 0 || length >= sizeof(cfg.deviceId)) { error = F("device_id must be 1-11 characters"); return false; }
+    for (size_t i = 0; i < length; i++) {
+      if (!isAlphaNumeric(value[i]) && value[i] != '-') { error = F("device_id may only contain letters, digits and '-'"); return false; }
+    }
+    strncpy(cfg.deviceId, value, sizeof(cfg.deviceId));
+  }
+  field = doc[F("mac")];
+  if (!field.isNull()) {
+    const char* value = field | "";
+    if (!parseMac(value, cfg.mac)) { error = F("mac must look like A8:61:0A:AE:34:F2"); return false; }
+  }
+  field = doc[F("log_mode")];
+  if (!field.isNull()) {
+    const char* value = field | "";
+    if (strcmp_P(value, PSTR("full")) == 0) cfg.logMode &= ~LOG_MODE_RAW;
+    else if (strcmp_P(value, PSTR("raw")) == 0) cfg.logMode |= LOG_MODE_RAW;
+    else { error = F("log_mode must be full or raw"); return false; }
+  }
+  field = doc[F("log_timestamps")];
+  if (!field.isNull()) {
+    const char* value = field | "";
+    if (strcmp_P(value, PSTR("iso")) == 0) cfg.logMode &= ~LOG_MODE_EPOCH;
+    else if (strcmp_P(value, PSTR("epoch")) == 0) cfg.logMode |= LOG_MODE_EPOCH;
+    else { error = F("log_timestamps must be iso or epoch"); return false; }
+  }
+  field = doc[F("banks")];
+  if (!field.isNull()) {
+    // An array of banks, each an array of battery numbers, e.g. [[1,2,3,4],[5,6,7,8]]
+    JsonArray list = field.as<JsonArray>();
+    if (list.isNull() || list.size() > MAX_BANKS) { error = F("banks must be an array of up to 4 arrays"); return false; }
+    memset(cfg.cellBank, 0, sizeof(cfg.cellBank));
+    uint8_t bank = 0;
+    for (JsonVariant cells : list) {
+      bank++;
+      if (!cells.is<JsonArray>()) { error = F("banks must be an array of up to 4 arrays"); return false; }
+      for (JsonVariant cell : cells.as<JsonArray>()) {
+        int battery = cell | 0;
+        if (battery < 1 || battery > MAX_BATTERIES) { error = F("banks: battery numbers must be 1-16"); return false; }
+        if (cfg.cellBank[battery - 1] != 0) { error = F("banks: a battery may only be in one bank"); return false; }
+        cfg.cellBank[battery - 1] = bank;
+      }
+    }
+  }
+  field = doc[F("bank_spread_alarm_mv")];
+  if (!field.isNull()) {
+    long value = field | -1L;
+    if (value < 0 || value > 10000) { error = F("bank_spread_alarm_mv must be 0-10000"); return false; }
+    cfg.bankSpreadAlarmMv = value;
+  }
+  field = doc[F("drop_drift_mv")];
+  if (!field.isNull()) {
+    long value = field | -1L;
+    if (value < 0 || value > 5000) { error = F("drop_drift_mv must be 0-5000"); return false; }
+    cfg.cusumDriftMv = value;
+  }
+  field = doc[F("drop_threshold_mv")];
+  if (!field.isNull()) {
+    long value = field | -1L;
+    if (value < 0 || value > 30000) { error = F("drop_threshold_mv must be 0-30000"); return false; }
+    cfg.cusumThresholdMv = value;
+  }
+  return true;
+}
+
+void writeConfigJson(Print& out, const DeviceConfig& cfg) {
+  char macText[18];
+  sprintf_P(macText, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"),
+          cfg.mac[0], cfg.mac[1], cfg.mac[2], cfg.mac[3], cfg.mac[4], cfg.mac[5]);
+
+  JsonDocument doc;
+  doc[F("num_batteries")] = cfg.numBatteries;
+  doc[F("log_interval_ms")] = cfg.logInterval;
+  doc[F("display_update_ms")] = cfg.displayUpdate;
+  doc[F("timezone_offset_s")] = cfg.timezoneOffset;
+  doc[F("ntp_server")] = cfg.ntpServer;
+  doc[F("device_id")] = cfg.deviceId;
+  doc[F("mac")] = macText;
+  doc[F("log_mode")] = (cfg.logMode & LOG_MODE_RAW) ? F("raw") : F("full");
+  doc[F("log_timestamps")] = (cfg.logMode & LOG_MODE_EPOCH) ? F("epoch") : F("iso");
+  JsonArray bankList = doc[F("banks")].to<JsonArray>();
+  for (uint8_t b = 1; b <= MAX_BANKS; b++) {
+    JsonArray cells;
+    for (uint8_t i = 0; i < MAX_BATTERIES; i++) {
+      if (cfg.cellBank[i] != b) continue;
+      if (cells.isNull()) {
+        // Banks are numbered by position, so fill any gap before this one
+        while (bankList.size() < b) cells = bankList.add<JsonArray>();
+      }
+      cells.add(i + 1);
+    }
+  }
+  doc[F("bank_spread_alarm_mv")] = cfg.bankSpreadAlarmMv;
+  doc[F("drop_drift_mv")] = cfg.cusumDriftMv;
+  doc[F("drop_threshold_mv")] = cfg.cusumThresholdMv;
+  serializeJson(doc, out);
+}
+
+void saveConfig(const DeviceConfig& cfg) {
+  EEPROM.put(EEPROM_CONFIG_ADDR, cfg); // Only changed bytes are rewritten
+
+  File oldFile = SD.open(CONFIG_FILE);
+  if (oldFile) {
+    uint32_t oldSize = oldFile.size();
+    oldFile.close();
+    if (SD.remove(CONFIG_FILE)) accountFileGrowth(oldSize, 0);
+  }
+  File configFile = SD.open(CONFIG_FILE, FILE_WRITE);
+  if (configFile) {
+    writeConfigJson(configFile, cfg);
+    configFile.println();
+    accountFileGrowth(0, configFile.size());
+    configFile.close();
+  } else {
+    Serial.println(F("Cannot write config.json; EEPROM copy updated"));
+  }
+}
+
+// Brings running state in line with a configuration that has just replaced
+// `previous`. Sampling continues throughout; only the network identity needs
+// a restart to take effect.
+void applyConfig(const DeviceConfig& previous) {
+  for (int i = previous.numBatteries; i < config.numBatteries; i++) {
+    batteries[i].rawValue = 0;
+    batteries[i].millivolts = 0;
+    batteries[i].voltage = 0.0;
+    batteries[i].percentage = 0.0;
+    batteries[i].isHealthy = true;
+    batteries[i].overRange = false;
+    batteries[i].lastUpdate = 0;
+    resetChannelFault(i);
+    quantiles[i].samples = 0; // Start today's percentiles afresh
+  }
+  if (currentDisplayBattery >= config.numBatteries) currentDisplayBattery = 0;
+
+  // Bank membership may have changed; alarms are re-evaluated on the next scan
+  for (uint8_t b = 0; b < MAX_BANKS; b++) banks[b].alarm = false;
+
+  resetDropDetectors();
+
+  // A new NTP server is looked up and used from the next request onward
+  if (strcmp(previous.ntpServer, config.ntpServer) != 0) {
+    ntpServerIP = IPAddress(0, 0, 0, 0);
+    ntpServerStale = true;
+  }
+
+  if (memcmp(previous.mac, config.mac, sizeof(config.mac)) != 0 ||
+      strcmp(previous.deviceId, config.deviceId) != 0) {
+    configRestartRequired = true;
+  }
+}
+
+void sendConfigResponse(EthernetClient& client, const __FlashStringHelper* status, const __FlashStringHelper* error) {
+  client.print(F("HTTP/1.1 "));
+  client.println(status);
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+
+  if (error != NULL) {
+    client.print(F("{\"error\":\""));
+    client.print(error);
+    client.println(F("\"}"));
+    return;
+  }
+
+  client.print(F("{\"source\":\""));
+  client.print(configSource);
+  client.print(F("\",\"restart_required\":"));
+  client.print(configRestartRequired ? F("true") : F("false"));
+  client.print(F(",\"config\":"));
+  writeConfigJson(client, config);
+  client.println('}');
+}
+
+// GET returns the active configuration. POST takes a JSON object with any
+// subset of the fields; it is validated as a whole against a staging copy
+// and only then swapped in, so a bad request never half-applies.
+void handleConfigRequest(HttpConnection& conn) {
+  if (strncmp_P(httpRequestLine, PSTR("POST"), 4) != 0) {
+    sendConfigResponse(conn.client, F("200 OK"), NULL);
+    return;
+  }
+
+  JsonDocument doc;
+  DeserializationError jsonError = deserializeJson(doc, conn.client);
+  if (jsonError) {
+    conn.status = 400;
+    sendConfigResponse(conn.client, F("400 Bad Request"), jsonError.f_str());
+    return;
+  }
+
+  DeviceConfig staged = config;
+  const __FlashStringHelper* error = NULL;
+  if (!parseConfigJson(doc, staged, error)) {
+    conn.status = 400;
+    sendConfigResponse(conn.client, F("400 Bad Request"), error);
+    return;
+  }
+  staged.crc = configCrc(staged);
+
+  saveConfig(staged);
+  DeviceConfig previous = config;
+  config = staged;
+  configSource = F("api");
+  applyConfig(previous);
+
+  Serial.println(F("Configuration updated via /api/config"));
+  sendConfigResponse(conn.client, F("200 OK"), NULL);
+}
+
+// Per-channel calibration
+//
+// Each channel is calibrated with two points: apply a known voltage (measured
+// with a meter) near the bottom of the range and capture it as "low", then
+// one near the top as "high". Once both are in, gain and offset are solved
+// and saved to EEPROM. Captures may come from the serial console or from
+// POST /api/calibrate.
+
+uint32_t calibrationCrc(const CalibrationTable& table) {
+  return crc32Update(0, &table, offsetof(CalibrationTable, crc));
+}
+
+void resetCalibration(uint8_t channel) {
+  calibration.channels[channel].gainQ16 = NOMINAL_GAIN_Q16;
+  calibration.channels[channel].offsetQ16 = 0;
+  calibration.compensated &= ~(1U << channel);
+  if (pendingCapture.channel == channel) pendingCapture.channel = CALIBRATION_NONE;
+}
+
+void saveCalibration() {
+  calibration.generation++;
+  calibration.crc = calibrationCrc(calibration);
+  EEPROM.put(EEPROM_CALIBRATION_ADDR, calibration);
+  updateEffectiveGains();
+  resetDropDetectors();
+}
+
+void updateEffectiveGains() {
+  for (uint8_t i = 0; i < MAX_BATTERIES; i++) {
+    int32_t gainQ16 = calibration.channels[i].gainQ16;
+    effectiveGainQ16[i] = (calibration.compensated & (1U << i)) ? ((int64_t)gainQ16 * avccScaleQ16) >> 16 : gainQ16;
+  }
+}
+
+// Measures AVCC by converting the internal bandgap with AVCC as reference:
+// ADC = 1024 * Vbg / AVCC, so AVCC = 1024 * Vbg / ADC.
+void measureAvcc() {
+  ADCSRB &= ~_BV(MUX5);
+  ADMUX = _BV(REFS0) | _BV(MUX4) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1); // AVCC ref, 1.1V bandgap input
+  delayMicroseconds(BANDGAP_SETTLE_US);
+
+  uint16_t sum = 0;
+  for (uint8_t i = 0; i <= BANDGAP_SAMPLES; i++) {
+    ADCSRA |= _BV(ADSC);
+    while (bit_is_set(ADCSRA, ADSC)) { ; }
+    if (i > 0) sum += ADC; // First conversion after the switch is discarded
+  }
+
+  // analogRead() reprograms the mux; one throwaway read lets the sample
+  // capacitor recover from the bandgap level before real channels are read
+  analogRead(batteries[0].analogPin);
+
+  if (sum == 0) return;
+  int32_t measured = (int32_t)BANDGAP_MV * 1024 * BANDGAP_SAMPLES / sum;
+  if (measured < AVCC_MIN_MV || measured > AVCC_MAX_MV) return;
+
+  avccMillivolts = measured;
+  avccScaleQ16 = (measured << 16) / NOMINAL_AVCC_MV;
+  updateEffectiveGains();
+}
+
+// Version 1 tables lack the compensated mask, with their CRC where it now
+// sits. The firmware that wrote them compensated every channel; only the
+// calibrated ones were solved that way, so only those are marked.
+bool upgradeCalibration() {
+  if (calibration.magic != CALIBRATION_MAGIC || calibration.version != 1) return false;
+
+  const uint8_t end = offsetof(CalibrationTable, compensated);
+  uint32_t crc;
+  memcpy(&crc, (uint8_t*)&calibration + end, sizeof(crc));
+  if (crc != crc32Update(0, &calibration, end)) return false;
+
+  calibration.version = CALIBRATION_VERSION;
+  calibration.compensated = 0;
+  for (uint8_t i = 0; i < MAX_BATTERIES; i++) {
+    const ChannelCalibration& cal = calibration.channels[i];
+    if (cal.gainQ16 != NOMINAL_GAIN_Q16 || cal.offsetQ16 != 0) calibration.compensated |= 1U << i;
+  }
+  calibration.crc = calibrationCrc(calibration);
+  EEPROM.put(EEPROM_CALIBRATION_ADDR, calibration);
+  return true;
+}
+
+void loadCalibration() {
+  EEPROM.get(EEPROM_CALIBRATION_ADDR, calibration);
+  if ((calibration.magic == CALIBRATION_MAGIC && calibration.version == CALIBRATION_VERSION &&
+       calibration.crc == calibrationCrc(calibration)) || upgradeCalibration()) {
+    Serial.print(F("Calibration loaded (generation "));
+    Serial.print(calibration.generation);
+    Serial.println(')');
+    updateEffectiveGains();
+    return;
+  }
+
+  Serial.println(F("No valid calibration in EEPROM, using nominal divider"));
+  calibration.magic = CALIBRATION_MAGIC;
+  calibration.version = CALIBRATION_VERSION;
+  calibration.generation = 0;
+  calibration.compensated = 0;
+  for (uint8_t i = 0; i < MAX_BATTERIES; i++) resetCalibration(i);
+  calibration.crc = calibrationCrc(calibration);
+  updateEffectiveGains();
+}
+
+// Records the current reading of `channel` against a reference voltage.
+// point is 0 for low, 1 for high. Returns an error message, or NULL.
+const __FlashStringHelper* captureCalibrationPoint(uint8_t channel, uint8_t point, int32_t millivolts) {
+  if (channel >= config.numBatteries) return F("invalid channel");
+  if (point > 1) return F("point must be low or high");
+  if (millivolts <= 0 || millivolts > 60000) return F("mv must be 1-60000");
+
+  uint16_t rawSum = 0;
+  for (uint8_t i = 0; i < CALIBRATION_SAMPLES; i++) {
+    rawSum += analogRead(batteries[channel].analogPin);
+  }
+
+  // Store the reading as it would be at nominal AVCC, so the solved gain is
+  // independent of the rail voltage at capture time
+  uint16_t rawQ4 = ((uint32_t)rawSum * 16 / CALIBRATION_SAMPLES * avccScaleQ16 + 32768) >> 16;
+
+  if (pendingCapture.channel != channel || pendingCapture.point == point) {
+    pendingCapture.channel = channel;
+    pendingCapture.point = point;
+    pendingCapture.rawQ4 = rawQ4;
+    pendingCapture.millivolts = millivolts;
+    return NULL;
+  }
+
+  // Both points present: solve for gain and offset
+  pendingCapture.channel = CALIBRATION_NONE;
+  float lowRaw = (point ? pendingCapture.rawQ4 : rawQ4) / 16.0;
+  float highRaw = (point ? rawQ4 : pendingCapture.rawQ4) / 16.0;
+  int32_t lowMv = point ? pendingCapture.millivolts : millivolts;
+  int32_t highMv = point ? millivolts : pendingCapture.millivolts;
+  if (highRaw <= lowRaw + 10 || highMv <= lowMv) {
+    return F("points too close together; capture both again");
+  }
+
+  float gain = (highMv - lowMv) / (highRaw - lowRaw);
+  float offset = lowMv - gain * lowRaw;
+  if (offset < -30000 || offset > 30000) return F("offset out of range");
+  // Keep raw * effective gain + offset inside int32 for every ADC code at
+  // the highest AVCC scale measureAvcc accepts
+  float worstQ16 = (gain * 1023.0 * AVCC_MAX_MV / NOMINAL_AVCC_MV + fabs(offset)) * 65536.0;
+  if (gain <= 0 || worstQ16 > 2.1e9) return F("gain out of range");
+
+  calibration.channels[channel].gainQ16 = (int32_t)(gain * 65536.0 + 0.5);
+  calibration.channels[channel].offsetQ16 = (int32_t)(offset * 65536.0);
+  calibration.compensated |= 1U << channel;
+  saveCalibration();
+
+  Serial.print(F("Channel "));
+  Serial.print(channel + 1);
+  Serial.print(F(" calibrated: "));
+  Serial.print(gain, 4);
+  Serial.print(F(" mV/code, offset "));
+  Serial.print(offset, 1);
+  Serial.println(F(" mV"));
+  return NULL;
+}
+
+void writeCalibrationJson(Print& out) {
+  out.print(F("{\"generation\":"));
+  out.print(calibration.generation);
+  out.print(F(",\"channels\":["));
+  for (uint8_t i = 0; i < config.numBatteries; i++) {
+    const ChannelCalibration& cal = calibration.channels[i];
+    if (i > 0) out.print(',');
+    out.print(F("{\"channel\":"));
+    out.print(i + 1);
+    out.print(F(",\"gain_q16\":"));
+    out.print(cal.gainQ16);
+    out.print(F(",\"offset_q16\":"));
+    out.print(cal.offsetQ16);
+    out.print(F(",\"mv_per_code\":"));
+    out.print(cal.gainQ16 / 65536.0, 4);
+    out.print(F(",\"offset_mv\":"));
+    out.print(cal.offsetQ16 / 65536.0, 1);
+    out.print(F(",\"avcc_compensated\":"));
+    out.print((calibration.compensated & (1U << i)) ? F("true") : F("false"));
+    out.print(F(",\"pending\":\""));
+    if (pendingCapture.channel == i) out.print(pendingCapture.point ? F("high") : F("low"));
+    out.print(F("\"}"));
+  }
+  out.print(F("]}"));
+}
+
+// GET /api/calibrate lists the coefficients.
+// POST /api/calibrate?channel=N&point=low|high&mv=M captures a point;
+// POST /api/calibrate?channel=N&reset=1 restores the nominal divider.
+void handleCalibrationRequest(HttpConnection& conn) {
+  EthernetClient& client = conn.client;
+  const __FlashStringHelper* error = NULL;
+
+  if (strncmp_P(httpRequestLine, PSTR("POST"), 4) == 0) {
+    char channelText[4], pointText[6], mvText[8], resetText[2];
+    int channel = getQueryParam(httpRequestLine, PSTR("channel"), channelText, sizeof(channelText)) ? atoi(channelText) : 0;
+
+    if (channel < 1 || channel > config.numBatteries) {
+      error = F("invalid channel");
+    } else if (getQueryParam(httpRequestLine, PSTR("reset"), resetText, sizeof(resetText))) {
+      resetCalibration(channel - 1);
+      saveCalibration();
+    } else if (!getQueryParam(httpRequestLine, PSTR("point"), pointText, sizeof(pointText)) ||
+               !getQueryParam(httpRequestLine, PSTR("mv"), mvText, sizeof(mvText))) {
+      error = F("point and mv are required");
+    } else {
+      uint8_t point = strcmp_P(pointText, PSTR("low")) == 0 ? 0 : strcmp_P(pointText, PSTR("high")) == 0 ? 1 : 2;
+      error = captureCalibrationPoint(channel - 1, point, atol(mvText));
+    }
+  }
+
+  client.println(error ? F("HTTP/1.1 400 Bad Request") : F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
   client.println();
 
-  client.print("{\"timestamp\":");
-  client.print(getUTCTimestamp());
-  client.print(",\"datetime\":\"");
-  client.print(getUSLocalTimeString());
-  client.print("\",\"batteries\":[");
+  if (error) {
+    conn.status = 400;
+    client.print(F("{\"error\":\""));
+    client.print(error);
+    client.println(F("\"}"));
+  } else {
+    writeCalibrationJson(client);
+    client.println();
+  }
+}
+
+// Copies the value of query parameter `name` from a request line such as
+// "POST /api/calibrate?channel=3&mv=12000 HTTP/1.1". Returns false if absent
+// or if the value does not fit.
+bool getQueryParam(const char* requestLine, PGM_P name, char* value, size_t size) {
+  const char* query = strchr(requestLine, '?');
+  if (query == NULL) return false;
+
+  size_t nameLength = strlen_P(name);
+  const char* p = query + 1;
+  while (*p && *p != ' ') {
+    if (strncmp_P(p, name, nameLength) == 0 && p[nameLength] == '=') {
+      p += nameLength + 1;
+      size_t length = 0;
+      while (p[length] && p[length] != '&' && p[length] != ' ') length++;
+      if (length >= size) return false;
+      memcpy(value, p, length);
+      value[length] = '\0';
+      return true;
+    }
+    while (*p && *p != '&' && *p != ' ') p++;
+    if (*p == '&') p++;
+  }
+  return false;
+}
+
+// Serial console. Commands:
+//   cal show                        list calibration coefficients
+//   cal <channel> low|high <mV>     capture a calibration point
+//   cal <channel> reset             restore the nominal divider
+//   trace                           dump the event trace ring (TRACE_ENABLED builds)
+const uint8_t SERIAL_COMMAND_MAX = 32;
+char serialCommand[SERIAL_COMMAND_MAX];
+uint8_t serialCommandLength = 0;
+
+void runSerialCommand(char* command) {
+  char* verb = strtok(command, " ");
+  if (verb == NULL) return;
+
+  if (strcmp_P(verb, PSTR("trace")) == 0) {
+#if TRACE_ENABLED
+    writeTraceJson(Serial);
+#else
+    Serial.println(F("Tracing not compiled in (build with -DTRACE_ENABLED=1)"));
+#endif
+    return;
+  }
+
+  if (strcmp_P(verb, PSTR("cal")) != 0) {
+    Serial.println(F("Unknown command. Try: cal show | cal <channel> low|high <mV> | cal <channel> reset | trace"));
+    return;
+  }
+
+  char* arg = strtok(NULL, " ");
+  if (arg == NULL || strcmp_P(arg, PSTR("show")) == 0) {
+    writeCalibrationJson(Serial);
+    Serial.println();
+    return;
+  }
+
+  int channel = atoi(arg);
+  char* action = strtok(NULL, " ");
+  if (channel < 1 || channel > config.numBatteries || action == NULL) {
+    Serial.println(F("Usage: cal <channel> low|high <mV> | cal <channel> reset"));
+    return;
+  }
+
+  const __FlashStringHelper* error = NULL;
+  if (strcmp_P(action, PSTR("reset")) == 0) {
+    resetCalibration(channel - 1);
+    saveCalibration();
+  } else {
+    char* mv = strtok(NULL, " ");
+    uint8_t point = strcmp_P(action, PSTR("low")) == 0 ? 0 : strcmp_P(action, PSTR("high")) == 0 ? 1 : 2;
+    error = mv ? captureCalibrationPoint(channel - 1, point, atol(mv)) : F("mV value required");
+  }
+
+  Serial.println(error ? error : F("OK"));
+}
+
+void handleSerialCommands() {
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      if (serialCommandLength > 0) {
+        serialCommand[serialCommandLength] = '\0';
+        runSerialCommand(serialCommand);
+        serialCommandLength = 0;
+      }
+    } else if (serialCommandLength < SERIAL_COMMAND_MAX - 1) {
+      serialCommand[serialCommandLength++] = c;
+    }
+  }
+}
+
+// CRC-32 (IEEE 802.3, as used by zlib). Chain calls by passing the previous
+// result; start with 0. Uses a 16-entry nibble table to stay small in flash.
+const uint32_t CRC32_NIBBLE_TABLE[16] PROGMEM = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t length) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  crc = ~crc;
+  while (length--) {
+    crc ^= *bytes++;
+    crc = pgm_read_dword(&CRC32_NIBBLE_TABLE[crc & 0x0F]) ^ (crc >> 4);
+    crc = pgm_read_dword(&CRC32_NIBBLE_TABLE[crc & 0x0F]) ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+// SNMP agent (v2c GET/GETNEXT)
+//
+// MIB layout, sorted lexicographically so GETNEXT is a single forward scan:
+//   1.3.6.1.2.1.1.1.0            sysDescr        OCTET STRING
+//   1.3.6.1.2.1.1.3.0            sysUpTime       TimeTicks
+//   1.3.6.1.2.1.1.5.0            sysName         OCTET STRING
+//   <ent>.1.1.0                  batteryCount    INTEGER
+//   <ent>.1.2.1.1.<n>            batteryIndex    INTEGER
+//   <ent>.1.2.1.2.<n>            batteryVoltage  Gauge32 (millivolts)
+//   <ent>.1.2.1.3.<n>            batterySoc      INTEGER (tenths of a percent)
+//   <ent>.1.2.1.4.<n>            batteryHealthy  INTEGER (TruthValue: 1=true, 2=false)
+//   <ent>.1.2.1.5.<n>            batteryRaw      INTEGER (ADC code)
+//   <ent>.1.2.1.6.<n>            batteryFault    INTEGER (ChannelFaultType + 1: 1=none, 2=openWire,
+//                                                3=railLow, 4=noisy)
+// where <ent> is 1.3.6.1.4.1.SNMP_ENTERPRISE and <n> is the 1-based battery number.
+
+enum SnmpObject {
+  SNMP_SYS_DESCR,
+  SNMP_SYS_UPTIME,
+  SNMP_SYS_NAME,
+  SNMP_BATTERY_COUNT,
+  SNMP_BATTERY_INDEX,
+  SNMP_BATTERY_VOLTAGE,
+  SNMP_BATTERY_SOC,
+  SNMP_BATTERY_HEALTHY,
+  SNMP_BATTERY_RAW,
+  SNMP_BATTERY_FAULT
+};
+
+struct SnmpMibEntry {
+  uint8_t object;    // SnmpObject
+  bool perBattery;   // true: table column indexed by battery, false: scalar (.0)
+  uint8_t length;
+  uint32_t oid[11];
+};
+
+#define SNMP_MIB2_SYSTEM 1, 3, 6, 1, 2, 1, 1
+#define SNMP_BATTERY_MIB 1, 3, 6, 1, 4, 1, SNMP_ENTERPRISE, 1
+
+const SnmpMibEntry SNMP_MIB[] PROGMEM = {
+  {SNMP_SYS_DESCR,       false, 8,  {SNMP_MIB2_SYSTEM, 1}},
+  {SNMP_SYS_UPTIME,      false, 8,  {SNMP_MIB2_SYSTEM, 3}},
+  {SNMP_SYS_NAME,        false, 8,  {SNMP_MIB2_SYSTEM, 5}},
+  {SNMP_BATTERY_COUNT,   false, 9,  {SNMP_BATTERY_MIB, 1}},
+  {SNMP_BATTERY_INDEX,   true,  11, {SNMP_BATTERY_MIB, 2, 1, 1}},
+  {SNMP_BATTERY_VOLTAGE, true,  11, {SNMP_BATTERY_MIB, 2, 1, 2}},
+  {SNMP_BATTERY_SOC,     true,  11, {SNMP_BATTERY_MIB, 2, 1, 3}},
+  {SNMP_BATTERY_HEALTHY, true,  11, {SNMP_BATTERY_MIB, 2, 1, 4}},
+  {SNMP_BATTERY_RAW,     true,  11, {SNMP_BATTERY_MIB, 2, 1, 5}},
+  {SNMP_BATTERY_FAULT,   true,  11, {SNMP_BATTERY_MIB, 2, 1, 6}}
+};
+const uint8_t SNMP_MIB_SIZE = sizeof(SNMP_MIB) / sizeof(SNMP_MIB[0]);
+
+// BER tags used by the agent
+const uint8_t BER_INTEGER = 0x02;
+const uint8_t BER_OCTET_STRING = 0x04;
+const uint8_t BER_NULL = 0x05;
+const uint8_t BER_OID = 0x06;
+const uint8_t BER_SEQUENCE = 0x30;
+const uint8_t BER_TIMETICKS = 0x43;
+const uint8_t BER_GAUGE32 = 0x42;
+const uint8_t BER_NO_SUCH_OBJECT = 0x80;
+const uint8_t BER_NO_SUCH_INSTANCE = 0x81;
+const uint8_t BER_END_OF_MIB_VIEW = 0x82;
+const uint8_t SNMP_PDU_GET = 0xA0;
+const uint8_t SNMP_PDU_GETNEXT = 0xA1;
+const uint8_t SNMP_PDU_RESPONSE = 0xA2;
+const uint8_t SNMP_VERSION_2C = 1;
+const uint8_t SNMP_ERROR_TOO_BIG = 1;
+
+const char SNMP_SYS_DESCR_TEXT[] PROGMEM = "Battery Monitor";
+
+// One buffer holds both the request and the response. The request is read
+// into the tail and the response is encoded from the front; the writer's
+// limit trails the reader so it only ever overwrites bytes already parsed.
+uint8_t snmpBuffer[SNMP_MAX_PACKET];
+
+struct SnmpReader {
+  const uint8_t* data;
+  size_t pos;
+  size_t end;
+};
+
+struct SnmpWriter {
+  uint8_t* data;
+  size_t pos;
+  size_t limit;
+  bool overflow;
+};
+
+// Reads a tag and length, returning false on malformed or truncated input.
+bool snmpReadHeader(SnmpReader& r, uint8_t expectedTag, size_t& length) {
+  if (r.pos + 2 > r.end || r.data[r.pos] != expectedTag) return false;
+  r.pos++;
+  uint8_t first = r.data[r.pos++];
+  if (first < 0x80) {
+    length = first;
+  } else {
+    uint8_t count = first & 0x7F;
+    if (count == 0 || count > 2 || r.pos + count > r.end) return false;
+    length = 0;
+    while (count--) length = (length << 8) | r.data[r.pos++];
+  }
+  return r.pos + length <= r.end;
+}
+
+bool snmpReadInteger(SnmpReader& r, int32_t& value) {
+  size_t length;
+  if (!snmpReadHeader(r, BER_INTEGER, length) || length == 0 || length > 4) return false;
+  value = (r.data[r.pos] & 0x80) ? -1 : 0;
+  for (size_t i = 0; i < length; i++) value = (value << 8) | r.data[r.pos++];
+  return true;
+}
+
+bool snmpReadOid(SnmpReader& r, uint32_t* oid, uint8_t& oidLength) {
+  size_t length;
+  if (!snmpReadHeader(r, BER_OID, length) || length == 0) return false;
+  size_t end = r.pos + length;
+  uint8_t first = r.data[r.pos++];
+  oid[0] = first / 40;
+  oid[1] = first % 40;
+  oidLength = 2;
+  uint32_t sub = 0;
+  while (r.pos < end) {
+    uint8_t b = r.data[r.pos++];
+    sub = (sub << 7) | (b & 0x7F);
+    if (!(b & 0x80)) {
+      if (oidLength >= SNMP_MAX_OID_LEN) return false;
+      oid[oidLength++] = sub;
+      sub = 0;
+    }
+  }
+  return true;
+}
+
+void snmpPutByte(SnmpWriter& w, uint8_t b) {
+  if (w.pos >= w.limit) {
+    w.overflow = true;
+    return;
+  }
+  w.data[w.pos++] = b;
+}
+
+// Constructed types are written with a fixed three-byte length (0x82 hi lo)
+// that is patched once the contents are known, so nothing is buffered twice.
+size_t snmpBeginSequence(SnmpWriter& w, uint8_t tag) {
+  snmpPutByte(w, tag);
+  size_t mark = w.pos;
+  snmpPutByte(w, 0x82);
+  snmpPutByte(w, 0);
+  snmpPutByte(w, 0);
+  return mark;
+}
+
+void snmpEndSequence(SnmpWriter& w, size_t mark) {
+  if (w.overflow) return;
+  size_t length = w.pos - mark - 3;
+  w.data[mark + 1] = length >> 8;
+  w.data[mark + 2] = length & 0xFF;
+}
+
+void snmpPutLength(SnmpWriter& w, size_t length) {
+  if (length < 0x80) {
+    snmpPutByte(w, length);
+  } else {
+    snmpPutByte(w, 0x81);
+    snmpPutByte(w, length);
+  }
+}
+
+void snmpPutInteger(SnmpWriter& w, uint8_t tag, int32_t value) {
+  uint8_t bytes = 4;
+  while (bytes > 1) {
+    int16_t top = (value >> ((bytes - 1) * 8 - 1)) & 0x1FF;
+    if (top != 0 && top != 0x1FF) break;
+    bytes--;
+  }
+  snmpPutByte(w, tag);
+  snmpPutByte(w, bytes);
+  while (bytes--) snmpPutByte(w, (value >> (bytes * 8)) & 0xFF);
+}
+
+// Unsigned application types (Gauge32, TimeTicks) need a leading zero when
+// the top bit is set.
+void snmpPutUnsigned(SnmpWriter& w, uint8_t tag, uint32_t value) {
+  uint8_t bytes = 1;
+  while (bytes < 4 && (value >> (bytes * 8)) != 0) bytes++;
+  bool pad = (value >> (bytes * 8 - 1)) & 1;
+  snmpPutByte(w, tag);
+  snmpPutByte(w, bytes + (pad ? 1 : 0));
+  if (pad) snmpPutByte(w, 0);
+  while (bytes--) snmpPutByte(w, (value >> (bytes * 8)) & 0xFF);
+}
+
+void snmpPutString(SnmpWriter& w, const char* value) {
+  size_t length = strlen(value);
+  snmpPutByte(w, BER_OCTET_STRING);
+  snmpPutLength(w, length);
+  for (size_t i = 0; i < length; i++) snmpPutByte(w, value[i]);
+}
+
+void snmpPutString_P(SnmpWriter& w, PGM_P value) {
+  size_t length = strlen_P(value);
+  snmpPutByte(w, BER_OCTET_STRING);
+  snmpPutLength(w, length);
+  for (size_t i = 0; i < length; i++) snmpPutByte(w, pgm_read_byte(value + i));
+}
+
+void snmpPutOid(SnmpWriter& w, const uint32_t* oid, uint8_t oidLength) {
+  uint8_t length = 1;
+  for (uint8_t i = 2; i < oidLength; i++) {
+    uint32_t sub = oid[i];
+    do {
+      length++;
+      sub >>= 7;
+    } while (sub);
+  }
+  snmpPutByte(w, BER_OID);
+  snmpPutLength(w, length);
+  snmpPutByte(w, oid[0] * 40 + oid[1]);
+  for (uint8_t i = 2; i < oidLength; i++) {
+    uint8_t groups = 0;
+    uint32_t sub = oid[i];
+    do {
+      groups++;
+      sub >>= 7;
+    } while (sub);
+    while (groups--) {
+      uint8_t b = (oid[i] >> (groups * 7)) & 0x7F;
+      snmpPutByte(w, groups ? (b | 0x80) : b);
+    }
+  }
+}
+
+// Lexicographic OID comparison; a proper prefix sorts before the longer OID.
+int snmpCompareOid(const uint32_t* a, uint8_t aLength, const uint32_t* b, uint8_t bLength) {
+  uint8_t n = aLength < bLength ? aLength : bLength;
+  for (uint8_t i = 0; i < n; i++) {
+    if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+  }
+  if (aLength == bLength) return 0;
+  return aLength < bLength ? -1 : 1;
+}
+
+// Resolves a request OID against the static MIB table. For GET the OID must
+// name an instance exactly; for GETNEXT the first instance after it is
+// returned and written back into oid/oidLength. Returns 0 when an instance
+// was found, otherwise the exception to report for the binding: a GET under
+// a known object with a bad index is noSuchInstance (RFC 3416 4.2.1).
+uint8_t snmpResolve(uint32_t* oid, uint8_t& oidLength, bool next, SnmpMibEntry& entry, uint8_t& row) {
+  for (uint8_t i = 0; i < SNMP_MIB_SIZE; i++) {
+    memcpy_P(&entry, &SNMP_MIB[i], sizeof(entry));
+    uint8_t rows = entry.perBattery ? config.numBatteries : 1;
+    int prefix = snmpCompareOid(oid, oidLength < entry.length ? oidLength : entry.length, entry.oid, entry.length);
+
+    if (!next) {
+      if (prefix != 0 || oidLength <= entry.length) continue;
+      uint32_t instance = oid[entry.length];
+      if (oidLength == entry.length + 1 &&
+          (entry.perBattery ? (instance >= 1 && instance <= rows) : instance == 0)) {
+        row = entry.perBattery ? instance - 1 : 0;
+        return 0;
+      }
+      return BER_NO_SUCH_INSTANCE;
+    }
+
+    uint32_t candidate;
+    if (prefix < 0 || (prefix == 0 && oidLength <= entry.length)) {
+      candidate = entry.perBattery ? 1 : 0;
+    } else if (prefix == 0) {
+      if (!entry.perBattery) continue; // Already at or past the scalar instance
+      candidate = oid[entry.length] + 1;
+      if (candidate > rows || candidate == 0) continue;
+    } else {
+      continue;
+    }
+
+    memcpy(oid, entry.oid, entry.length * sizeof(uint32_t));
+    oid[entry.length] = candidate;
+    oidLength = entry.length + 1;
+    row = entry.perBattery ? candidate - 1 : 0;
+    return 0;
+  }
+  return next ? BER_END_OF_MIB_VIEW : BER_NO_SUCH_OBJECT;
+}
+
+void snmpPutValue(SnmpWriter& w, const SnmpMibEntry& entry, uint8_t row) {
+  switch (entry.object) {
+    case SNMP_SYS_DESCR:
+      snmpPutString_P(w, SNMP_SYS_DESCR_TEXT);
+      break;
+    case SNMP_SYS_UPTIME:
+      snmpPutUnsigned(w, BER_TIMETICKS, millis() / 10);
+      break;
+    case SNMP_SYS_NAME:
+      snmpPutString(w, mdnsHostname.c_str());
+      break;
+    case SNMP_BATTERY_COUNT:
+      snmpPutInteger(w, BER_INTEGER, config.numBatteries);
+      break;
+    case SNMP_BATTERY_INDEX:
+      snmpPutInteger(w, BER_INTEGER, row + 1);
+      break;
+    case SNMP_BATTERY_VOLTAGE:
+      snmpPutUnsigned(w, BER_GAUGE32, batteries[row].millivolts);
+      break;
+    case SNMP_BATTERY_SOC:
+      snmpPutInteger(w, BER_INTEGER, (int32_t)(batteries[row].percentage * 10.0 + 0.5));
+      break;
+    case SNMP_BATTERY_HEALTHY:
+      snmpPutInteger(w, BER_INTEGER, batteries[row].isHealthy ? 1 : 2); // False while faulted
+      break;
+    case SNMP_BATTERY_RAW:
+      snmpPutInteger(w, BER_INTEGER, batteries[row].rawValue);
+      break;
+    case SNMP_BATTERY_FAULT:
+      snmpPutInteger(w, BER_INTEGER, channelFaults[row].fault + 1);
+      break;
+  }
+}
+
+// Parses the request held in snmpBuffer[start, start + length) and builds
+// the response in place from the front of the buffer. Returns the response
+// length, or 0 to drop the request.
+size_t snmpProcess(size_t start, size_t length) {
+  SnmpReader r = {snmpBuffer, start, start + length};
+  size_t seqLength;
+  int32_t version;
+  if (!snmpReadHeader(r, BER_SEQUENCE, seqLength)) return 0;
+  r.end = r.pos + seqLength;
+  if (!snmpReadInteger(r, version) || version != SNMP_VERSION_2C) return 0;
+
+  size_t communityLength;
+  if (!snmpReadHeader(r, BER_OCTET_STRING, communityLength)) return 0;
+  if (communityLength != strlen_P(SNMP_COMMUNITY) ||
+      memcmp_P(r.data + r.pos, SNMP_COMMUNITY, communityLength) != 0) {
+    return 0; // Wrong community: silently drop, as RFC 3584 suggests
+  }
+  r.pos += communityLength;
+
+  if (r.pos >= r.end) return 0;
+  uint8_t pduType = r.data[r.pos];
+  if (pduType != SNMP_PDU_GET && pduType != SNMP_PDU_GETNEXT) return 0;
+  size_t pduLength;
+  if (!snmpReadHeader(r, pduType, pduLength)) return 0;
+
+  int32_t requestId, errorStatus, errorIndex;
+  if (!snmpReadInteger(r, requestId) || !snmpReadInteger(r, errorStatus) || !snmpReadInteger(r, errorIndex)) return 0;
+
+  size_t bindingsLength;
+  if (!snmpReadHeader(r, BER_SEQUENCE, bindingsLength)) return 0;
+  size_t bindingsEnd = r.pos + bindingsLength;
+
+  SnmpWriter w = {snmpBuffer, 0, r.pos, false};
+  size_t message = snmpBeginSequence(w, BER_SEQUENCE);
+  snmpPutInteger(w, BER_INTEGER, SNMP_VERSION_2C);
+  snmpPutString_P(w, SNMP_COMMUNITY);
+  size_t pdu = snmpBeginSequence(w, SNMP_PDU_RESPONSE);
+  snmpPutInteger(w, BER_INTEGER, requestId);
+  size_t errorStatusPos = w.pos;
+  snmpPutInteger(w, BER_INTEGER, 0);
+  snmpPutInteger(w, BER_INTEGER, 0);
+  size_t bindings = snmpBeginSequence(w, BER_SEQUENCE);
+  if (w.overflow) return 0; // Header would overrun the unread request
+
+  while (r.pos < bindingsEnd) {
+    size_t bindingLength;
+    if (!snmpReadHeader(r, BER_SEQUENCE, bindingLength)) return 0;
+    size_t bindingEnd = r.pos + bindingLength;
+
+    uint32_t oid[SNMP_MAX_OID_LEN];
+    uint8_t oidLength;
+    if (!snmpReadOid(r, oid, oidLength)) return 0;
+    r.pos = bindingEnd; // Ignore the (NULL) value in the request
+    w.limit = r.pos;    // The binding is parsed; its bytes may be overwritten
+
+    SnmpMibEntry entry;
+    uint8_t row;
+    uint8_t exception = snmpResolve(oid, oidLength, pduType == SNMP_PDU_GETNEXT, entry, row);
+
+    size_t binding = snmpBeginSequence(w, BER_SEQUENCE);
+    snmpPutOid(w, oid, oidLength);
+    if (exception == 0) {
+      snmpPutValue(w, entry, row);
+    } else {
+      snmpPutByte(w, exception);
+      snmpPutByte(w, 0);
+    }
+    snmpEndSequence(w, binding);
+
+    if (w.overflow) {
+      // tooBig: resend the header with an empty variable-binding list. The
+      // rest of the request is no longer needed, so the whole buffer is free.
+      w.overflow = false;
+      w.limit = SNMP_MAX_PACKET;
+      w.pos = errorStatusPos;
+      snmpPutInteger(w, BER_INTEGER, SNMP_ERROR_TOO_BIG);
+      snmpPutInteger(w, BER_INTEGER, 0);
+      bindings = snmpBeginSequence(w, BER_SEQUENCE);
+      break;
+    }
+  }
 
-  for (int i = 0; i < NUM_BATTERIES; i++) {
-    client.print("{");
-    client.print("\"id\":");
-    client.print(i + 1);
-    client.print(",\"raw\":");
-    client.print(batteries[i].rawValue);
-    client.print(",\"voltage\":");
-    client.print(batteries[i].voltage, 3);
-    client.print(",\"percentage\":");
-    client.print(batteries[i].percentage, 1);
-    client.print(",\"healthy\":");
-    client.print(batteries[i].isHealthy ? "true" : "false");
-    client.print("}");
-    if (i < NUM_BATTERIES - 1) client.print(",");
+  snmpEndSequence(w, bindings);
+  snmpEndSequence(w, pdu);
+  snmpEndSequence(w, message);
+  return w.overflow ? 0 : w.pos;
+}
+
+void handleSnmpRequests() {
+  int packetSize = snmpUDP.parsePacket();
+  if (packetSize <= 0) return;
+
+  if ((size_t)packetSize > SNMP_MAX_PACKET) {
+    snmpUDP.flush(); // Oversized request: drop it
+    return;
+  }
+
+  size_t start = SNMP_MAX_PACKET - packetSize;
+  int length = snmpUDP.read(snmpBuffer + start, packetSize);
+  if (length <= 0) return;
+
+  size_t responseLength = snmpProcess(start, length);
+  if (responseLength == 0) return;
+
+  snmpUDP.beginPacket(snmpUDP.remoteIP(), snmpUDP.remotePort());
+  snmpUDP.write(snmpBuffer, responseLength);
+  snmpUDP.endPacket();
+}
+
+// Watchdog supervision
+
+// Reports why the last reset happened and which task was to blame, then
+// clears the per-reset state for this run.
+void initWatchdog() {
+  if (watchdogState.magic != WATCHDOG_STATE_MAGIC || (resetFlags & _BV(PORF))) {
+    watchdogState.magic = WATCHDOG_STATE_MAGIC;
+    watchdogState.currentTask = TASK_NONE;
+    watchdogState.stalledTask = TASK_NONE;
+    watchdogState.watchdogResets = 0;
+  }
+
+  if (resetFlags & _BV(WDRF)) {
+    lastResetCause = F("watchdog");
+    watchdogState.watchdogResets++;
+    // A missed deadline names the task directly; otherwise the task that
+    // was running when the watchdog fired is the one that hung
+    lastStalledTask = watchdogState.stalledTask != TASK_NONE ? watchdogState.stalledTask : watchdogState.currentTask;
+  } else if (resetFlags & _BV(BORF)) {
+    lastResetCause = F("brownout");
+  } else if (resetFlags & _BV(EXTRF)) {
+    lastResetCause = F("external");
+  } else if (resetFlags & _BV(PORF)) {
+    lastResetCause = F("power-on");
+  } else {
+    lastResetCause = F("unknown");
   }
 
-  client.println("]}");
+  Serial.print(F("Reset cause: "));
+  Serial.println(lastResetCause);
+  if (lastStalledTask < TASK_COUNT) {
+    Serial.print(F("Stalled task: "));
+    Serial.println((const __FlashStringHelper*)TASK_NAMES[lastStalledTask]);
+  }
+
+  watchdogState.currentTask = TASK_NONE;
+  watchdogState.stalledTask = TASK_NONE;
 }
 
-void sendHistoryData(EthernetClient& client) {
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-Type: application/json");
-  client.println("Connection: close");
-  client.println();
+void beginTask(uint8_t task) {
+  watchdogState.currentTask = task;
+}
 
-  client.println("{\"history\":[");
+void endTask(uint8_t task) {
+  watchdogState.currentTask = TASK_NONE;
+  taskLastCheckIn[task] = millis();
+}
 
-  File logFile = SD.open("battery.csv");
-  if (logFile) {
-    String line;
-    bool firstLine = true;
-    bool firstDataLine = true;
+void feedWatchdog() {
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    if (now - taskLastCheckIn[i] > TASK_LIVENESS_TIMEOUT) {
+      // Starve the watchdog; the reset will report this task
+      if (watchdogState.stalledTask == TASK_NONE) watchdogState.stalledTask = i;
+      return;
+    }
+  }
+  wdt_reset();
+}
+
+// Warm-reset recovery of the preserved state
+void restorePersistentState() {
+  // A firmware update that changes the layout also changes the magic
+  const uint32_t magic = PERSISTENT_MAGIC ^ sizeof(PersistentState);
+  bool warm = !(resetFlags & _BV(PORF)) && persistent.magic == magic;
+  persistent.magic = magic;
+
+  if (!warm || !isBlockSealed(counters)) {
+    memset(&counters, 0, sizeof(counters));
+    warm = false;
+  }
+
+  // Pending samples are checked one by one when they are flushed
+  SampleRing& ring = persistent.ring;
+  if (!warm || !isBlockSealed(ring) || ring.head >= SAMPLE_RING_SIZE || ring.count > SAMPLE_RING_SIZE) {
+    ring.head = 0;
+    ring.count = 0;
+    sealBlock(ring);
+  }
+
+  // Repeats of a run still open are written as an R line by setup() once the
+  // log tail has been recovered
+  if (!warm || !isBlockSealed(logRun)) {
+    memset(&logRun, 0, sizeof(logRun));
+    sealBlock(logRun);
+  }
+
+  if (warm) {
+    counters.warmResets++;
+    Serial.print(F("Warm reset: recovered counters, "));
+    Serial.print(ring.count);
+    Serial.print(F(" pending samples and "));
+    Serial.print(logRun.repeats);
+    Serial.println(F(" repeats"));
+  }
+  sealBlock(counters);
+}
+
+// Crash-safe log recovery
+//
+// A power cut in the middle of logBatteryData() can leave the active log
+// segment ending in a partial record. At boot only the tail of the file is
+// examined: it is read backwards, at most LOG_RECOVERY_MAX_SCAN bytes, until
+// the last newline, and anything after it is cut off. sealLogTail() then
+// takes the block sequence from the last "#<seq>" trailer in that tail and
+// closes any records left after it with an unsealed trailer. The cost
+// depends on the record length, not on the size of the log.
+void recoverLogTail() {
+  if (!sdRawReady) return;
+
+  unsigned long startTime = millis();
+  SdFile root;
+  SdFile log;
+  if (!root.openRoot(&sdVolume)) return;
+  if (!log.open(&root, logFileName, O_RDWR)) {
+    root.close();
+    return; // No log yet
+  }
+
+  uint32_t size = log.fileSize();
+  int32_t keep = findLineStart(log, size);
+
+  if (keep < 0) {
+    Serial.println(F("Log tail check: no record boundary found near the end, leaving file as is"));
+  } else if ((uint32_t)keep < size) {
+    log.truncate(keep);
+    logRepairedBytes = size - keep;
+    Serial.print(F("Log tail repaired: removed "));
+    Serial.print(logRepairedBytes);
+    Serial.print(F(" bytes of partial record in "));
+    Serial.print(millis() - startTime);
+    Serial.println(F(" ms"));
+  }
+
+  if (keep > 0) sealLogTail(log, keep);
+
+  log.close();
+  root.close();
+
+  // Not even the header survived; let setup() recreate the file
+  if (keep == 0) SD.remove(logFileName);
+}
+
+// Offset just past the last newline before `end` (0 if there is none), or -1
+// if none turns up within LOG_RECOVERY_MAX_SCAN bytes.
+int32_t findLineStart(SdFile& file, uint32_t end) {
+  uint32_t limit = end;
+  uint8_t window[LOG_RECOVERY_WINDOW];
+
+  while (end > 0) {
+    if (limit - end >= LOG_RECOVERY_MAX_SCAN) return -1;
+    uint16_t count = min(end, (uint32_t)LOG_RECOVERY_WINDOW);
+    if (!file.seekSet(end - count) || file.read(window, count) != count) return -1;
+
+    for (int16_t i = count - 1; i >= 0; i--) {
+      if (window[i] == '\n') return end - count + i + 1;
+    }
+    end -= count;
+  }
+  return 0;
+}
+
+// Reads the first bytes of the line at `start` into `line`; returns its
+// first character, or 0 if it cannot be read.
+char readLogLineStart(SdFile& log, uint32_t start, char* line, uint8_t size) {
+  if (!log.seekSet(start)) return 0;
+  int16_t length = log.read(line, size - 1);
+  if (length <= 0) return 0;
+  line[length] = '\0';
+  return line[0];
+}
+
+// Picks up the block sequence from the last trailer line, searching back up
+// to LOG_RECOVERY_MAX_SCAN bytes from the end. If the log ends in records
+// without a trailer (a flush cut short, or a log written by older firmware)
+// they are closed with an unsealed "#<seq>,-" trailer, so the next block's
+// CRC starts at a clean boundary.
+void sealLogTail(SdFile& log, uint32_t end) {
+  int32_t lastLine = findLineStart(log, end - 1);
+  if (lastLine == 0) return; // Only the header
+
+  char line[12];
+  int32_t lineStart = lastLine;
+  bool seqFound = false;
+  while (lineStart > 0 && end - lineStart <= LOG_RECOVERY_MAX_SCAN) {
+    if (readLogLineStart(log, lineStart, line, sizeof(line)) == '#') {
+      logBlockSeq = strtoul(line + 1, NULL, 10) + 1;
+      seqFound = true;
+      break;
+    }
+    lineStart = findLineStart(log, lineStart - 1);
+  }
+
+  if (seqFound && lineStart == lastLine) return; // Already sealed
+
+  log.seekSet(end);
+  log.print('#');
+  log.print(logBlockSeq++);
+  log.println(F(",-"));
+  Serial.println(F("Log tail had no block trailer; marked as unsealed"));
+  if (!seqFound) Serial.println(F("No earlier block trailer near the end; block sequence restarts"));
+}
+
+void writeLogTrailer(Print& out, uint32_t crc) {
+  char trailer[24];
+  sprintf_P(trailer, PSTR("#%lu,%08lx"), (unsigned long)logBlockSeq++, (unsigned long)crc);
+  out.println(trailer);
+}
 
-    while (logFile.available()) {
-      line = logFile.readStringUntil('\n');
-      line.trim();
+void resetLogBlockScanner(LogBlockScanner& scanner) {
+  memset(&scanner, 0, sizeof(scanner));
+  scanner.state = SCAN_LINE_START;
+}
+
+// Feeds log bytes to the scanner and returns how many were consumed. Stops
+// right after a trailer line, with `result` giving the block's verdict;
+// otherwise `result` is BLOCK_NONE and all bytes were consumed.
+uint16_t scanLogBlock(LogBlockScanner& scanner, const uint8_t* data, uint16_t length, uint8_t& result) {
+  result = BLOCK_NONE;
+  uint16_t i = 0;
+
+  while (i < length) {
+    uint8_t c = data[i];
+
+    if (scanner.state == SCAN_TRAILER_SEQ || scanner.state == SCAN_TRAILER_CRC) {
+      i++;
+      if (c == '\n') {
+        if (scanner.malformed || scanner.state != SCAN_TRAILER_CRC) result = BLOCK_CORRUPT;
+        else if (scanner.voided) result = BLOCK_VOID;
+        else if (scanner.unsealed) result = BLOCK_UNSEALED;
+        else result = scanner.trailerCrc == scanner.crc ? BLOCK_VALID : BLOCK_CORRUPT;
+        return i;
+      }
+      if (c == '\r') continue;
 
-      if (firstLine) {
-        firstLine = false;
-        continue; // Skip header
+      if (scanner.state == SCAN_TRAILER_SEQ) {
+        if (c >= '0' && c <= '9') scanner.trailerSeq = scanner.trailerSeq * 10 + (c - '0');
+        else if (c == ',') scanner.state = SCAN_TRAILER_CRC;
+        else scanner.malformed = true;
+      } else if (c >= '0' && c <= '9') {
+        scanner.trailerCrc = (scanner.trailerCrc << 4) | (c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        scanner.trailerCrc = (scanner.trailerCrc << 4) | (c - 'a' + 10);
+      } else if (c == '-') {
+        scanner.unsealed = true;
+      } else if (c == 'x') {
+        scanner.voided = true;
+      } else {
+        scanner.malformed = true;
       }
+      continue;
+    }
+
+    if (scanner.state == SCAN_LINE_START && c == '#') {
+      scanner.state = SCAN_TRAILER_SEQ;
+      i++;
+      continue;
+    }
 
-      if (line.length() > 0) {
-        if (!firstDataLine) client.print(",");
+    // Fold the rest of the record line into the CRC in one call
+    uint16_t end = i;
+    while (end < length && data[end] != '\n') end++;
+    if (end < length) end++;
+    scanner.crc = crc32Update(scanner.crc, data + i, end - i);
+    scanner.bytes += end - i;
+    scanner.state = data[end - 1] == '\n' ? SCAN_LINE_START : SCAN_RECORD;
+    i = end;
+  }
+  return i;
+}
 
-        int commaIndex = line.indexOf(',');
-        String timestamp = line.substring(0, commaIndex);
-        String data = line.substring(commaIndex + 1);
+// Scans up to LOG_SCAN_CHUNK bytes of the file, leaving it positioned just
+// after the trailer if a block ends. Returns BLOCK_NONE if the block goes on
+// past this chunk, BLOCK_UNSEALED for records at the end of the file with no
+// trailer, and BLOCK_END at the end of the file.
+uint8_t scanLogChunk(File& file, LogBlockScanner& scanner) {
+  uint8_t buffer[LOG_SCAN_BUFFER];
+  uint16_t total = 0;
 
-        client.print("{\"timestamp\":\"");
-        client.print(timestamp);
-        client.print("\",\"data\":[");
+  while (total < LOG_SCAN_CHUNK) {
+    uint32_t position = file.position();
+    int count = file.read(buffer, sizeof(buffer));
+    if (count <= 0) return scanner.bytes > 0 ? BLOCK_UNSEALED : BLOCK_END;
 
-        int startIndex = 0;
-        int batteryIndex = 0;
+    uint8_t result;
+    uint16_t used = scanLogBlock(scanner, buffer, count, result);
+    if (result != BLOCK_NONE) {
+      file.seek(position + used);
+      return result;
+    }
+    total += count;
+  }
+  return BLOCK_NONE;
+}
 
-        while (startIndex < (int)data.length() && batteryIndex < NUM_BATTERIES) {
-          if (batteryIndex > 0) client.print(",");
+void countLogBlock(LogBlockStats& stats, const LogBlockScanner& scanner, uint8_t result) {
+  if (result == BLOCK_CORRUPT) {
+    // A damaged trailer's sequence number cannot be trusted
+    stats.corrupt++;
+    return;
+  }
 
-          // Raw value
-          int nextComma = data.indexOf(',', startIndex);
-          String rawValue = data.substring(startIndex, nextComma);
-          startIndex = nextComma + 1;
+  // Records cut off at the end of the file have no trailer to check
+  if (scanner.state == SCAN_TRAILER_CRC) {
+    if (stats.valid + stats.unsealed + stats.voided > 0 && scanner.trailerSeq != stats.nextSeq) stats.sequenceGaps++;
+    stats.nextSeq = scanner.trailerSeq + 1;
+  }
+  if (result == BLOCK_VALID) stats.valid++;
+  else if (result == BLOCK_VOID) stats.voided++;
+  else stats.unsealed++;
+}
 
-          // Voltage
-          nextComma = data.indexOf(',', startIndex);
-          String voltage = data.substring(startIndex, nextComma);
-          startIndex = nextComma + 1;
+// Log segments
+void logSegmentName(uint16_t segment, char* name) {
+  if (segment == 0) strcpy(name, LEGACY_LOG_FILE);
+  else sprintf_P(name, PSTR("LOG%05u.CSV"), segment);
+}
 
-          // Percentage
-          nextComma = data.indexOf(',', startIndex);
-          if (nextComma == -1) nextComma = data.length();
-          String percentage = data.substring(startIndex, nextComma);
-          startIndex = nextComma + 1;
+// Finds the oldest and newest segments in the root directory
+void findLogSegments() {
+  oldestLogSegment = LOG_SEGMENT_LIMIT;
+  activeLogSegment = 0;
 
-          client.print("{\"raw\":");
-          client.print(rawValue);
-          client.print(",\"voltage\":");
-          client.print(voltage);
-          client.print(",\"percentage\":");
-          client.print(percentage);
-          client.print("}");
+  File root = SD.open("/");
+  if (root) {
+    while (true) {
+      File entry = root.openNextFile();
+      if (!entry) break;
 
-          batteryIndex++;
+      const char* name = entry.name();
+      if (!entry.isDirectory() && strlen(name) == 12 && strncmp_P(name, PSTR("LOG"), 3) == 0 && strcmp_P(name + 8, PSTR(".CSV")) == 0) {
+        uint32_t segment = strtoul(name + 3, NULL, 10);
+        if (segment > 0 && segment <= LOG_SEGMENT_LIMIT) {
+          if (segment < oldestLogSegment) oldestLogSegment = segment;
+          if (segment > activeLogSegment) activeLogSegment = segment;
         }
+      }
+      entry.close();
+    }
+    root.close();
+  }
+
+  if (activeLogSegment == 0) activeLogSegment = 1;
+  if (SD.exists(LEGACY_LOG_FILE)) oldestLogSegment = 0;
+  else if (oldestLogSegment > activeLogSegment) oldestLogSegment = activeLogSegment;
+  logSegmentName(activeLogSegment, logFileName);
+}
+
+// Creates a segment holding just the header and makes it the active one
+bool startLogSegment(uint16_t segment) {
+  char name[13];
+  logSegmentName(segment, name);
+  File logFile = SD.open(name, FILE_WRITE);
+  if (!logFile) return false;
+
+  CrcPrint header(logFile);
+  writeLogHeader(header);
+  activeHeaderCrc = header.crc;
+  activeLogSize = logFile.size();
+  accountFileGrowth(0, activeLogSize);
+  logFile.close();
+
+  activeLogSegment = segment;
+  strcpy(logFileName, name);
+  logWriteFailed = false;
+  Serial.print(F("Started log segment "));
+  Serial.println(logFileName);
+  return true;
+}
+
+void writeLogHeader(Print& out) {
+  out.print((config.logMode & LOG_MODE_EPOCH) ? F("Epoch_ms") : F("DateTime_UTC"));
+  out.print(F(",Boot,Tick_ms,"));
+  if (config.logMode & LOG_MODE_RAW) {
+    out.print(F("Cal,AVCC_mV"));
+    for (int i = 0; i < config.numBatteries; i++) {
+      out.print(F(",Battery"));
+      out.print(i + 1);
+      out.print(F("_Raw"));
+    }
+    out.println();
+    return;
+  }
+  for (int i = 0; i < config.numBatteries; i++) {
+    out.print(F("Battery"));
+    out.print(i + 1);
+    out.print(F("_Raw,Battery"));
+    out.print(i + 1);
+    out.print(F("_Voltage,Battery"));
+    out.print(i + 1);
+    out.print(F("_Percentage"));
+    if (i < config.numBatteries - 1) out.print(',');
+  }
+  for (uint8_t b = 1; b <= bankCount(); b++) {
+    out.print(F(",Bank"));
+    out.print(b);
+    out.print(F("_V,Bank"));
+    out.print(b);
+    out.print(F("_Spread_mV,Bank"));
+    out.print(b);
+    out.print(F("_Worst"));
+  }
+  out.println();
+}
+
+// CRC of the header the current configuration would write
+uint32_t logHeaderCrc() {
+  NullPrint sink;
+  CrcPrint header(sink);
+  writeLogHeader(header);
+  return header.crc;
+}
+
+// Reads a segment's header line, returning the optional columns it names.
+// Also gives the number of battery columns and the CRC of the line.
+uint8_t readLogHeader(File& file, uint32_t& crc, uint8_t& batteries) {
+  uint8_t format = 0;
+  char column[16];
+  uint8_t length = 0;
+
+  crc = 0;
+  batteries = 0;
+  while (file.available()) {
+    uint8_t c = file.read();
+    crc = crc32Update(crc, &c, 1);
+
+    if (c == ',' || c == '\r' || c == '\n') {
+      column[length] = '\0';
+      if (strcmp_P(column, PSTR("Boot")) == 0) format |= LOG_FORMAT_BOOT_TICK;
+      if (strcmp_P(column, PSTR("Cal")) == 0) format |= LOG_FORMAT_RAW_ONLY;
+      if (strcmp_P(column, PSTR("Epoch_ms")) == 0) format |= LOG_FORMAT_EPOCH;
+      if (strncmp_P(column, PSTR("Bank"), 4) == 0) format |= LOG_FORMAT_BANKS;
+      if (length > 4 && strcmp_P(column + length - 4, PSTR("_Raw")) == 0) batteries++;
+      length = 0;
+      if (c == '\n') break;
+    } else if (length < sizeof(column) - 1) {
+      column[length++] = c;
+    }
+  }
+  return format;
+}
+
+// Opens the first segment numbered `segment` or later, positioned after its
+// header. `segment` is left at the one opened, and `format` and `batteries`
+// are set from its header.
+File openLogSegment(uint16_t& segment, uint8_t& format, uint8_t& batteries) {
+  char name[13];
+  for (; segment <= activeLogSegment; segment++) {
+    logSegmentName(segment, name);
+    File file = SD.open(name);
+    if (file) {
+      uint32_t crc;
+      format = readLogHeader(file, crc, batteries);
+      return file;
+    }
+  }
+  return File();
+}
+
+// Moves a history or verify stream on to the next segment
+bool openNextLogSegment(HttpConnection& conn) {
+  conn.scanBytes += conn.file.size();
+  conn.file.close();
+  if (conn.segment >= activeLogSegment) return false;
+
+  conn.segment++;
+  conn.file = openLogSegment(conn.segment, conn.logFormat, conn.logBatteries);
+  if (!conn.file) return false;
+
+  conn.blockStart = conn.file.position();
+  conn.blockEnd = 0;
+  resetLogBlockScanner(conn.scanner);
+  resetHistoryRepeats(conn);
+  return true;
+}
+
+// SD free space tracking
+uint32_t clustersFor(uint32_t bytes) {
+  uint32_t clusterBytes = sdVolume.blocksPerCluster() * 512UL;
+  return (bytes + clusterBytes - 1) / clusterBytes;
+}
+
+uint32_t adjustFreeClusters(uint32_t count, uint32_t allocated, uint32_t released) {
+  if (released > 0) return count + released;
+  return allocated < count ? count - allocated : 0;
+}
+
+// Applies a file's change of size, either way, to the free count and to the
+// count of a scan in progress
+void accountFileGrowth(uint32_t before, uint32_t after) {
+  if (!sdFreeKnown && !sdFreeScanning) return;
+  uint32_t was = clustersFor(before);
+  uint32_t now = clustersFor(after);
+  uint32_t allocated = now > was ? now - was : 0;
+  uint32_t released = was > now ? was - now : 0;
+  if (sdFreeKnown) sdFreeClusters = adjustFreeClusters(sdFreeClusters, allocated, released);
+  if (sdFreeScanning) sdFreeScanCount = adjustFreeClusters(sdFreeScanCount, allocated, released);
+}
+
+// The previous count stays in use until the new one is complete
+void startFreeSpaceScan() {
+  sdFreeScanCount = 0;
+  sdFreeScanBlock = 0;
+  sdFreeScanTime = millis();
+  sdFreeScanning = sdRawReady && (sdVolume.fatType() == 16 || sdVolume.fatType() == 32);
+}
+
+// Counts free FAT entries, a few FAT blocks per call. Each block is read in
+// LOG_SCAN_BUFFER-byte slices and always finished within the call, so the
+// card is deselected again before the Ethernet chip uses the bus.
+void continueFreeSpaceScan() {
+  if (!sdFreeScanning) {
+    if (sdFreeKnown && millis() - sdFreeScanTime >= SD_FREE_RESCAN_INTERVAL) startFreeSpaceScan();
+    return;
+  }
+
+  uint8_t entrySize = sdVolume.fatType() == 16 ? 2 : 4;
+  uint32_t entries = sdVolume.clusterCount() + 2; // Entries 0 and 1 are reserved
+  uint32_t fatBlocks = (entries * entrySize + 511) / 512;
+  uint8_t slice[LOG_SCAN_BUFFER];
+
+  sdCard.partialBlockRead(true);
+  for (uint8_t n = 0; n < FREE_SCAN_BLOCKS_PER_PASS && sdFreeScanBlock < fatBlocks; n++, sdFreeScanBlock++) {
+    uint32_t entry = sdFreeScanBlock * (512 / entrySize);
 
-        client.print("]}");
-        firstDataLine = false;
+    for (uint16_t offset = 0; offset < 512; offset += sizeof(slice)) {
+      if (!sdCard.readData(sdVolume.fatStartBlock() + sdFreeScanBlock, offset, sizeof(slice), slice)) {
+        sdCard.partialBlockRead(false);
+        sdFreeScanning = false;
+        Serial.println(F("SD free space scan failed"));
+        return;
+      }
+
+      for (uint8_t i = 0; i < sizeof(slice); i += entrySize, entry++) {
+        if (entry < 2 || entry >= entries) continue;
+        uint32_t value = slice[i] | (uint16_t)slice[i + 1] << 8;
+        if (entrySize == 4) value |= (uint32_t)slice[i + 2] << 16 | (uint32_t)(slice[i + 3] & 0x0F) << 24;
+        if (value == 0) sdFreeScanCount++;
       }
     }
-    logFile.close();
   }
+  sdCard.partialBlockRead(false);
 
-  client.println("]}");
+  if (sdFreeScanBlock >= fatBlocks) {
+    sdFreeScanning = false;
+    sdFreeKnown = true;
+    sdFreeClusters = sdFreeScanCount;
+    Serial.print(F("SD free space: "));
+    Serial.print(sdFreeClusters);
+    Serial.print(F(" of "));
+    Serial.print(sdVolume.clusterCount());
+    Serial.println(F(" clusters"));
+  }
 }
 
-void send404(EthernetClient& client) {
-  client.println("HTTP/1.1 404 Not Found");
-  client.println("Content-Type: text/html");
-  client.println("Connection: close");
-  client.println();
-  client.println("<h1>404 - Not Found</h1>");
+bool logSegmentInUse(uint16_t segment) {
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    HttpConnection& conn = httpConnections[i];
+    if (conn.state != HTTP_FREE && conn.file && conn.segment == segment) return true;
+  }
+  return false;
+}
+
+// Deletes the oldest segments once free space falls below the low watermark,
+// until it is back above the target. Never the active segment, nor one a
+// client is still streaming: pruning stops there and resumes on a later flush
+// once that client has moved on.
+void pruneLogSegments() {
+  if (!sdFreeKnown) return;
+
+  uint32_t clusters = sdVolume.clusterCount();
+  if (sdFreeClusters >= clusters / 100 * SD_PRUNE_BELOW_PERCENT) return;
+
+  uint32_t target = clusters / 100 * SD_PRUNE_TARGET_PERCENT;
+  while (sdFreeClusters < target && oldestLogSegment < activeLogSegment) {
+    if (logSegmentInUse(oldestLogSegment)) return;
+    char name[13];
+    logSegmentName(oldestLogSegment, name);
+    File segment = SD.open(name);
+    if (segment) {
+      uint32_t size = segment.size();
+      segment.close();
+      if (!SD.remove(name)) {
+        // Keep it as the oldest segment and try again on a later pass
+        Serial.print(F("SD space low, could not remove "));
+        Serial.println(name);
+        return;
+      }
+      sdFreeClusters += clustersFor(size);
+      logSegmentsPruned++;
+      Serial.print(F("SD space low, pruned "));
+      Serial.println(name);
+    } else if (SD.exists(name)) {
+      Serial.print(F("SD space low, could not open "));
+      Serial.println(name);
+      return;
+    }
+    oldestLogSegment++;
+  }
+
+  if (sdFreeClusters < target) {
+    Serial.println(F("SD card nearly full and no old log segments left to prune"));
+  }
+}
+
+// Print has no 64-bit overload
+size_t printUint64(Print& out, uint64_t value) {
+  char digits[21];
+  uint8_t i = sizeof(digits) - 1;
+  digits[i] = '\0';
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  return out.print(digits + i);
+}
+
+// Network supervisor
+//
+// Polls the link once a second. While the link is up the DHCP lease is
+// maintained; after repeated failed rebinds the fallback address is used and
+// DHCP is retried every DHCP_RETRY_INTERVAL. Whenever the address changes the
+// mDNS responder is restarted so the new address is announced.
+void superviseNetwork(unsigned long now) {
+  if (now - lastNetworkCheck < NETWORK_CHECK_INTERVAL) return;
+  lastNetworkCheck = now;
+
+  bool up = Ethernet.linkStatus() != LinkOFF; // Unknown (no PHY status) counts as up
+  if (up != linkUp) {
+    linkUp = up;
+    if (!up) {
+      networkStats.linkDowns++;
+      linkDownSince = now;
+      Serial.println(F("Ethernet link down"));
+    } else {
+      networkStats.linkDownMs += now - linkDownSince;
+      Serial.println(F("Ethernet link up"));
+      // May be plugged into a different network: try DHCP straight away
+      if (!usingDhcp) lastDhcpAttempt = now - DHCP_RETRY_INTERVAL;
+    }
+  }
+  if (!linkUp) return;
+
+  // Both calls below may block for a few seconds
+  feedWatchdog();
+
+  if (usingDhcp) {
+    switch (Ethernet.maintain()) {
+      case DHCP_CHECK_RENEW_OK:
+      case DHCP_CHECK_REBIND_OK:
+        networkStats.dhcpRenewals++;
+        dhcpFailureStreak = 0;
+        checkAddressChange();
+        break;
+      case DHCP_CHECK_RENEW_FAIL:
+        networkStats.dhcpFailures++;
+        break;
+      case DHCP_CHECK_REBIND_FAIL:
+        networkStats.dhcpFailures++;
+        if (++dhcpFailureStreak >= DHCP_FAILURES_BEFORE_FALLBACK) {
+          Serial.println(F("DHCP lease lost, using fallback IP"));
+          usingDhcp = false;
+          lastDhcpAttempt = now;
+          useFallbackAddress();
+          checkAddressChange();
+        }
+        break;
+    }
+  } else if (now - lastDhcpAttempt >= DHCP_RETRY_INTERVAL) {
+    lastDhcpAttempt = now;
+    usingDhcp = requestDhcpAddress();
+    if (usingDhcp) {
+      dhcpFailureStreak = 0;
+      Serial.println(F("DHCP lease obtained"));
+    } else {
+      useFallbackAddress(); // A failed request leaves no address configured
+    }
+    checkAddressChange();
+  }
+}
+
+bool requestDhcpAddress() {
+  if (Ethernet.begin(bootMac, DHCP_TIMEOUT, DHCP_RESPONSE_TIMEOUT) != 0) return true;
+  networkStats.dhcpFailures++;
+  return false;
+}
+
+void useFallbackAddress() {
+  Ethernet.begin(bootMac, IPAddress(FALLBACK_IP[0], FALLBACK_IP[1], FALLBACK_IP[2], FALLBACK_IP[3]));
+}
+
+void checkAddressChange() {
+  IPAddress current = Ethernet.localIP();
+  if (current == assignedIP) return;
+
+  Serial.print(F("IP address changed to "));
+  Serial.println(current);
+  assignedIP = current;
+  networkStats.addressChanges++;
+  if (!startMdns()) Serial.println(F("mDNS failed to restart"));
+}
+
+// (Re)starts the responder on the current address. Its socket is closed
+// first so that restarting does not use up another of the W5500's sockets.
+bool startMdns() {
+  mdns.removeAllServiceRecords();
+  udp.stop();
+  if (!mdns.begin(assignedIP, mdnsHostname.c_str())) return false;
+
+  String serviceName = mdnsHostname + F("._http");
+  mdns.addServiceRecord(serviceName.c_str(), 80, MDNSServiceTCP, mdnsTxt);
+  networkStats.mdnsAnnouncements++;
+  return true;
+}
+
+// TXT record for the HTTP service, so collectors can see what the device
+// serves without extra requests. Returns false if something did not fit.
+bool buildMdnsTxt() {
+  uint8_t length = 0;
+  mdnsTxt[0] = '\0';
+  if (!appendMdnsTxt(length, MDNS_TXT_VERSION, NULL) ||
+      !appendMdnsTxt(length, MDNS_TXT_PATH, NULL) ||
+      !appendMdnsTxt(length, MDNS_TXT_FORMATS, NULL) ||
+      !appendMdnsTxt(length, PSTR("id="), config.deviceId)) {
+    return false;
+  }
+
+  // api=/api/current,/api/history,... from the route table, each name added
+  // to the string in place
+  uint8_t start = length;
+  if (!appendMdnsTxt(length, PSTR("api="), NULL)) return false;
+  for (uint8_t route = 0; route < ROUTE_COUNT; route++) {
+    if (route == ROUTE_DASHBOARD || route == ROUTE_NOT_FOUND) continue;
+    if (route == ROUTE_TRACE && !TRACE_ENABLED) continue;
+    PGM_P name = (PGM_P)pgm_read_ptr(&ROUTE_NAMES[route]);
+    bool first = length == start + sizeof("api=");
+    uint8_t size = strlen_P(name) + (first ? 0 : 1);
+    if (length + size + 1 > MDNS_TXT_MAX) return false;
+    if (!first) mdnsTxt[length++] = ',';
+    strcpy_P(mdnsTxt + length, name);
+    length += strlen_P(name);
+    mdnsTxt[start] += size;
+  }
+  return true;
+}
+
+// Appends one length-prefixed string to the TXT record: `text` from flash,
+// then `suffix` if given. Returns false, leaving the record as it was, if
+// it does not fit.
+bool appendMdnsTxt(uint8_t& length, PGM_P text, const char* suffix) {
+  uint8_t size = strlen_P(text) + (suffix ? strlen(suffix) : 0);
+  if (length + size + 2 > MDNS_TXT_MAX) return false;
+
+  mdnsTxt[length++] = size;
+  strcpy_P(mdnsTxt + length, text);
+  if (suffix) strcat(mdnsTxt + length, suffix);
+  length += size;
+  return true;
+}
+
+// One responder tick: a few packets within the time budget, then whatever is
+// still queued is counted and dropped
+void runMdnsTask() {
+  unsigned long start = micros();
+  uint8_t runs = 0;
+  while (runs < MDNS_MAX_RUNS_PER_TICK && micros() - start < MDNS_TICK_BUDGET_US) {
+    TRACE_BEGIN(TRACE_MDNS_RUN, runs);
+    mdns.run();
+    TRACE_END(TRACE_MDNS_RUN, runs);
+    runs++;
+  }
+
+  if (runs < MDNS_MAX_RUNS_PER_TICK) {
+    networkStats.mdnsBudgetExhausted++;
+    // Bounded too, in case packets arrive as fast as they are discarded
+    for (uint8_t i = 0; i < MDNS_MAX_DROPS_PER_TICK && udp.parsePacket() > 0; i++) {
+      networkStats.mdnsDropped++;
+    }
+  }
+  networkStats.mdnsBusyUs += micros() - start;
 }
 
 // Time functions implementation
 void initializeNTP() {
-  Serial.print("Initializing NTP client...");
+  Serial.print(F("Initializing NTP client..."));
   lcd.setCursor(0, 1);
-  lcd.print("Syncing time... ");
+  lcd.print(F("Syncing time... "));
 
-  timeClient.begin();
-  timeClient.update();
+  ntpUDP.begin(NTP_LOCAL_PORT);
 
-  int attempts = 0;
-  while (!timeClient.isTimeSet() && attempts < 10) {
-    delay(1000);
-    timeClient.update();
-    attempts++;
-    Serial.print(".");
+  for (uint8_t attempt = 0; attempt < NTP_BOOT_ATTEMPTS && !clockIsSet(); attempt++) {
+    sendNtpRequest();
+    while (ntpPending && millis() - ntpRequestTick < NTP_REPLY_TIMEOUT) {
+      receiveNtpReply();
+      delay(10);
+    }
+    if (ntpPending) {
+      ntpPending = false;
+      ntpFailures++;
+    }
+    Serial.print('.');
   }
 
-  if (timeClient.isTimeSet()) {
-    Serial.println(" Success!");
-    setTime(timeClient.getEpochTime());
+  if (clockIsSet()) {
+    Serial.println(F(" Success!"));
+    setTime(getUTCTimestamp());
     lcd.setCursor(0, 1);
-    lcd.print("Time synced!    ");
+    lcd.print(F("Time synced!    "));
   } else {
-    Serial.println(" Failed!");
+    Serial.println(F(" Failed!"));
     lcd.setCursor(0, 1);
-    lcd.print("Time sync failed");
+    lcd.print(F("Time sync failed"));
   }
   delay(2000);
 }
 
-unsigned long getUTCTimestamp() {
-  if (timeClient.isTimeSet()) {
-    return timeClient.getEpochTime();
+// Runs every loop pass: picks up a pending reply, or sends the next request
+// when it is due (more often until the clock has been set)
+void updateClock() {
+  if (ntpPending) {
+    if (!receiveNtpReply() && millis() - ntpRequestTick >= NTP_REPLY_TIMEOUT) {
+      ntpPending = false;
+      ntpFailures++;
+      ntpServerStale = true; // The address may have moved
+    }
+    return;
   }
-  return 0;
+
+  unsigned long interval = clockIsSet() ? NTP_UPDATE_INTERVAL : NTP_RETRY_INTERVAL;
+  if (millis() - lastNtpRequest >= interval) {
+    // The request may start with a server lookup; feed here rather than in
+    // resolveNtpServer(), which also runs from setup() before the watchdog
+    if (ntpServerStale) feedWatchdog();
+    sendNtpRequest();
+  }
+}
+
+// Looks config.ntpServer up, blocking for at most 3 * NTP_DNS_TIMEOUT.
+// beginPacket(host, port) would do a blocking lookup with the library's
+// default timeout on every request. A failed lookup keeps the old address.
+void resolveNtpServer() {
+  DNSClient dns;
+  dns.begin(Ethernet.dnsServerIP());
+  IPAddress address;
+  if (dns.getHostByName(config.ntpServer, address, NTP_DNS_TIMEOUT) == 1) {
+    ntpServerIP = address;
+    ntpServerStale = false;
+  }
+}
+
+void sendNtpRequest() {
+  // Looked up again only after a lost reply or a config change
+  if (ntpServerStale) resolveNtpServer();
+
+  uint8_t packet[NTP_PACKET_SIZE];
+  memset(packet, 0, sizeof(packet));
+  packet[0] = 0x23; // LI 0, version 4, mode 3 (client)
+
+  // The server echoes the transmit timestamp back as the originate
+  // timestamp, which ties a reply to this request
+  lastNtpRequest = ntpRequestTick = millis();
+  for (uint8_t i = 0; i < 4; i++) packet[40 + i] = ntpRequestTick >> (24 - 8 * i);
+
+  ntpPending = ntpServerIP != IPAddress(0, 0, 0, 0) &&
+               ntpUDP.beginPacket(ntpServerIP, NTP_PORT) &&
+               ntpUDP.write(packet, sizeof(packet)) == sizeof(packet) &&
+               ntpUDP.endPacket();
+  if (!ntpPending) ntpFailures++;
+}
+
+// Applies a reply to the latest request, if one has arrived. The server's
+// transmit time plus half the round trip is taken as the time of arrival.
+bool receiveNtpReply() {
+  if (ntpUDP.parsePacket() < NTP_PACKET_SIZE) return false;
+
+  uint8_t packet[NTP_PACKET_SIZE];
+  ntpUDP.read(packet, sizeof(packet));
+  uint32_t arrival = millis();
+
+  uint32_t originate = 0;
+  uint32_t seconds = 0;
+  uint32_t fraction = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    originate = originate << 8 | packet[24 + i];
+    seconds = seconds << 8 | packet[40 + i];
+    fraction = fraction << 8 | packet[44 + i];
+  }
+
+  // Server mode, synchronised (stratum 1-15), answering our latest request
+  if ((packet[0] & 0x07) != 4 || packet[1] == 0 || packet[1] > 15 || originate != ntpRequestTick) return false;
+
+  ntpRoundTripMs = arrival - ntpRequestTick;
+  uint64_t serverMs = (uint64_t)(seconds - NTP_UNIX_OFFSET) * 1000 + (((uint64_t)fraction * 1000) >> 32);
+  uint64_t nowMs = serverMs + ntpRoundTripMs / 2;
+
+  bool first = !clockIsSet();
+  int32_t stepMs = first ? 0 : (int32_t)(int64_t)(nowMs - (clockBaseMs + (arrival - clockBaseTick)));
+  clockBaseMs = nowMs;
+  clockBaseTick = arrival;
+  ntpPending = false;
+
+  noteClockSync(first, stepMs);
+  return true;
+}
+
+bool clockIsSet() {
+  return clockBaseMs != 0;
+}
+
+// Current UTC time in milliseconds, 0 if the clock has never been set
+uint64_t epochMillis() {
+  if (!clockIsSet()) return 0;
+  return clockBaseMs + (uint32_t)(millis() - clockBaseTick);
+}
+
+// Boot id: a counter in EEPROM, bumped at every start
+void loadBootId() {
+  BootRecord record;
+  EEPROM.get(EEPROM_BOOT_ID_ADDR, record);
+  bootId = record.check == ~record.id ? record.id + 1 : 1;
+
+  record.id = bootId;
+  record.check = ~bootId;
+  EEPROM.put(EEPROM_BOOT_ID_ADDR, record);
+
+  Serial.print(F("Boot id: "));
+  Serial.println(bootId);
+}
+
+// Called after each NTP sync with how far it moved the clock. The first
+// sync of the boot, and any real step after it, go to CLOCK.CSV.
+void noteClockSync(bool first, int32_t stepMs) {
+  if (!first && labs(stepMs) < CLOCK_STEP_THRESHOLD_MS) return;
+
+  ClockMapping mapping;
+  mapping.boot = bootId;
+  mapping.tick = clockBaseTick;
+  mapping.epochMs = clockBaseMs;
+  if (first) {
+    bootClock = mapping;
+  } else {
+    clockSteps++;
+    Serial.print(F("Clock stepped by "));
+    Serial.print(stepMs);
+    Serial.println(F(" ms"));
+  }
+
+  File clockLog = SD.open(CLOCK_LOG_FILE, FILE_WRITE);
+  if (!clockLog) return;
+  uint32_t startSize = clockLog.size();
+  if (startSize == 0) clockLog.println(F("Boot,Tick_ms,Epoch_ms,Step_ms"));
+  clockLog.print(mapping.boot);
+  clockLog.print(',');
+  clockLog.print(mapping.tick);
+  clockLog.print(',');
+  printUint64(clockLog, mapping.epochMs);
+  clockLog.print(',');
+  clockLog.println(stepMs);
+  accountFileGrowth(startSize, clockLog.size());
+  clockLog.close();
+}
+
+// Finds the first sync of a boot, from memory for this boot or CLOCK.CSV
+// for earlier ones. The last lookup is cached, hits and misses alike, as
+// history records come in long runs from the same boot.
+bool findClockMapping(uint32_t boot, ClockMapping& mapping) {
+  if (boot == bootId) {
+    mapping = bootClock;
+    return mapping.epochMs != 0;
+  }
+
+  if (cachedClock.boot != boot) {
+    cachedClock.boot = boot;
+    cachedClock.tick = 0;
+    cachedClock.epochMs = 0;
+
+    File clockLog = SD.open(CLOCK_LOG_FILE);
+    if (clockLog) {
+      char line[48];
+      clockLog.readBytesUntil('\n', line, sizeof(line)); // Skip header
+      while (clockLog.available()) {
+        uint8_t length = clockLog.readBytesUntil('\n', line, sizeof(line) - 1);
+        line[length] = '\0';
+
+        char* field;
+        if (strtoul(line, &field, 10) != boot || *field != ',') continue;
+        cachedClock.tick = strtoul(field + 1, &field, 10);
+        cachedClock.epochMs = parseUint64(field + 1, NULL);
+        break;
+      }
+      clockLog.close();
+    }
+  }
+
+  mapping = cachedClock;
+  return mapping.epochMs != 0;
+}
+
+uint64_t epochFromTick(const ClockMapping& mapping, uint32_t tick) {
+  return mapping.epochMs + (int32_t)(tick - mapping.tick);
+}
+
+// UTC milliseconds from a log timestamp, "2024-09-26T20:30:45Z" with or
+// without a ".mmm" fraction; 0 if it cannot be read
+uint64_t parseIsoTimestamp(const char* text) {
+  int year, month, day, hour, minute, second;
+  int fraction = 0;
+  if (sscanf_P(text, PSTR("%4d-%2d-%2dT%2d:%2d:%2d.%3d"), &year, &month, &day, &hour, &minute, &second, &fraction) < 6) return 0;
+
+  tmElements_t tm;
+  tm.Year = CalendarYrToTm(year);
+  tm.Month = month;
+  tm.Day = day;
+  tm.Hour = hour;
+  tm.Minute = minute;
+  tm.Second = second;
+  return (uint64_t)makeTime(tm) * 1000 + fraction;
+}
+
+// strtoul for 64-bit values (avr-libc has no strtoull)
+uint64_t parseUint64(const char* text, char** end) {
+  uint64_t value = 0;
+  while (*text >= '0' && *text <= '9') value = value * 10 + (*text++ - '0');
+  if (end != NULL) *end = (char*)text;
+  return value;
+}
+
+unsigned long getUTCTimestamp() {
+  return epochMillis() / 1000;
 }
 
 String getUTCTimeString() {
-  if (!timeClient.isTimeSet()) {
-    return "Time not synced";
+  if (!clockIsSet()) {
+    return F("Time not synced");
   }
 
-  unsigned long utc = timeClient.getEpochTime();
+  unsigned long utc = getUTCTimestamp();
   tmElements_t tm;
   breakTime(utc, tm);
 
   char buffer[32];
-  sprintf(buffer, "%04d-%02d-%02d %02d:%02d:%02d UTC",
+  sprintf_P(buffer, PSTR("%04d-%02d-%02d %02d:%02d:%02d UTC"),
           tmYearToCalendar(tm.Year), tm.Month, tm.Day,
           tm.Hour, tm.Minute, tm.Second);
 
@@ -632,16 +5518,16 @@ String getUTCTimeString() {
 }
 
 String getLocalTimeString() {
-  if (!timeClient.isTimeSet()) {
-    return "Time not synced";
+  if (!clockIsSet()) {
+    return F("Time not synced");
   }
 
-  unsigned long local = timeClient.getEpochTime() + TIMEZONE_OFFSET;
+  unsigned long local = getUTCTimestamp() + config.timezoneOffset;
   tmElements_t tm;
   breakTime(local, tm);
 
   char buffer[32];
-  sprintf(buffer, "%04d-%02d-%02d %02d:%02d:%02d",
+  sprintf_P(buffer, PSTR("%04d-%02d-%02d %02d:%02d:%02d"),
           tmYearToCalendar(tm.Year), tm.Month, tm.Day,
           tm.Hour, tm.Minute, tm.Second);
 
@@ -649,47 +5535,43 @@ String getLocalTimeString() {
 }
 
 String getUSLocalTimeString() {
-  if (!timeClient.isTimeSet()) {
-    return "Time not synced";
+  if (!clockIsSet()) {
+    return F("Time not synced");
   }
 
-  unsigned long local = timeClient.getEpochTime() + TIMEZONE_OFFSET;
+  unsigned long local = getUTCTimestamp() + config.timezoneOffset;
   tmElements_t tm;
   breakTime(local, tm);
 
   // Convert to 12-hour format
   int hour12 = tm.Hour;
-  String ampm = "AM";
+  char ampm = 'A';
   if (hour12 == 0) {
     hour12 = 12;
   } else if (hour12 > 12) {
     hour12 -= 12;
-    ampm = "PM";
+    ampm = 'P';
   } else if (hour12 == 12) {
-    ampm = "PM";
+    ampm = 'P';
   }
 
   char buffer[32];
-  sprintf(buffer, "%02d/%02d/%04d %d:%02d:%02d %s",
+  sprintf_P(buffer, PSTR("%02d/%02d/%04d %d:%02d:%02d %cM"),
           tm.Month, tm.Day, tmYearToCalendar(tm.Year),
-          hour12, tm.Minute, tm.Second, ampm.c_str());
+          hour12, tm.Minute, tm.Second, ampm);
 
   return String(buffer);
 }
 
-String getDateTimeForCSV() {
-  if (!timeClient.isTimeSet()) {
-    return "1970-01-01T00:00:00Z";
-  }
-
-  unsigned long utc = timeClient.getEpochTime();
+// Formats UTC milliseconds for the log; 0 (never synced) gives 1970-01-01T00:00:00.000Z
+String getDateTimeForCSV(uint64_t epochMs) {
   tmElements_t tm;
-  breakTime(utc, tm);
+  breakTime(epochMs / 1000, tm);
 
   char buffer[32];
-  sprintf(buffer, "%04d-%02d-%02dT%02d:%02d:%02dZ",
+  sprintf_P(buffer, PSTR("%04d-%02d-%02dT%02d:%02d:%02d.%03dZ"),
           tmYearToCalendar(tm.Year), tm.Month, tm.Day,
-          tm.Hour, tm.Minute, tm.Second);
+          tm.Hour, tm.Minute, tm.Second, (int)(epochMs % 1000));
 
   return String(buffer);
 }
\ No newline at end of file